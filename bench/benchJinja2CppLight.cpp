@@ -0,0 +1,372 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, 
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <string>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+
+#include "bench/bench_supp.h"
+
+#include "Jinja2CppLight.h"
+#include "templatecache.h"
+
+using namespace std;
+using namespace Jinja2CppLight;
+
+namespace {
+    // an OpenCL-ish kernel, with a few loops and substitutions, and a fair
+    // amount of literal text in between
+    string kernelSource() {
+        string source = "";
+        for( int block = 0; block < 20; block++ ) {
+            source += "// some explanation of what block " + toString( block ) + " is about\n";
+            source += "kernel void k" + toString( block ) + "( global const float *image, global float *out ) {\n";
+            source += "    const int globalId = get_global_id(0);\n";
+            source += "    {% for i in range(its) %}out[{{i}}] = image[{{i}} + {{offset}}] * {{scale}};\n";
+            source += "    {% endfor %}\n";
+            source += "    {% if useBias %}out[globalId] += {{bias}};{% endif %}\n";
+            source += "}\n";
+        }
+        return source;
+    }
+}
+
+BENCH( benchJinja2CppLight, compileSmall ) {
+    const string source = R"DELIM(
+        This is my {{avalue}} template.  It's {{secondvalue}}...
+        Today's weather is {{weather}}.
+    )DELIM";
+    state.setBytesProcessed( source.size() );
+    while( state.next() ) {
+        CompiledTemplate compiled( source );
+        state.keep( compiled.root->sections.size() );
+    }
+}
+
+BENCH( benchJinja2CppLight, compileLarge ) {
+    string source = "";
+    for( int i = 0; i < 50; i++ ) {
+        source += kernelSource();
+    }
+    state.setBytesProcessed( source.size() );
+    while( state.next() ) {
+        CompiledTemplate compiled( source );
+        state.keep( compiled.root->sections.size() );
+    }
+}
+
+BENCH( benchJinja2CppLight, compileKernel ) {
+    const string source = kernelSource();
+    state.setBytesProcessed( source.size() );
+    while( state.next() ) {
+        CompiledTemplate compiled( source );
+        state.keep( compiled.root->sections.size() );
+    }
+}
+
+BENCH( benchJinja2CppLight, compileAndRenderKernel ) {
+    const string source = kernelSource();
+    while( state.next() ) {
+        Template mytemplate( source );
+        mytemplate.setValue( "its", 4 );
+        mytemplate.setValue( "offset", 16 );
+        mytemplate.setValue( "scale", 0.5f );
+        mytemplate.setValue( "useBias", 1 );
+        mytemplate.setValue( "bias", 1.5f );
+        state.keep( mytemplate.render().size() );
+    }
+}
+
+BENCH( benchJinja2CppLight, renderCompiledKernel ) {
+    Template mytemplate( kernelSource() );
+    mytemplate.setValue( "its", 4 );
+    mytemplate.setValue( "offset", 16 );
+    mytemplate.setValue( "scale", 0.5f );
+    mytemplate.setValue( "useBias", 1 );
+    mytemplate.setValue( "bias", 1.5f );
+    mytemplate.compile();
+    while( state.next() ) {
+        state.keep( mytemplate.render().size() );
+    }
+}
+
+BENCH( benchJinja2CppLight, renderSubstitutions ) {
+    string source = "";
+    for( int i = 0; i < 100; i++ ) {
+        source += "const float w" + toString( i ) + " = {{ weight }} * {{scale}}; // {{name}}\n";
+    }
+    Template mytemplate( source );
+    mytemplate.setValue( "weight", 3 );
+    mytemplate.setValue( "scale", 0.25f );
+    mytemplate.setValue( "name", "conv1" );
+    mytemplate.compile();
+    while( state.next() ) {
+        state.keep( mytemplate.render().size() );
+    }
+}
+
+namespace {
+    // a loop of 1000 iterations, rendered with contextSize values set, of
+    // which the template only uses two
+    void benchLoopWithContext( bench::State &state, int contextSize ) {
+        Template mytemplate( "{% for i in range(its) %}a[{{i}}] = {{value}};\n{% endfor %}" );
+        for( int i = 0; i < contextSize; i++ ) {
+            mytemplate.setValue( "unused" + toString( i ), i );
+        }
+        mytemplate.setValue( "its", 1000 );
+        mytemplate.setValue( "value", 1.5f );
+        mytemplate.compile();
+        while( state.next() ) {
+            state.keep( mytemplate.render().size() );
+        }
+    }
+}
+
+BENCH( benchJinja2CppLight, renderLoopContext10 ) {
+    benchLoopWithContext( state, 10 );
+}
+
+BENCH( benchJinja2CppLight, renderLoopContext1000 ) {
+    benchLoopWithContext( state, 1000 );
+}
+
+BENCH( benchJinja2CppLight, renderLoopContext100000 ) {
+    benchLoopWithContext( state, 100000 );
+}
+
+BENCH( benchJinja2CppLight, renderUnrolledLoop ) {
+    Template mytemplate( "{% for i in range(its) %}sum += a[{{i}}];\n{% endfor %}" );
+    mytemplate.setValue( "its", 50000 );
+    mytemplate.compile();
+    while( state.next() ) {
+        state.keep( mytemplate.render().size() );
+    }
+}
+
+namespace {
+    class CountingSink : public OutputSink {
+    public:
+        size_t bytes;
+        CountingSink() :
+            bytes( 0 ) {
+        }
+        virtual void write( const char *data, size_t length ) {
+            bytes += length;
+        }
+    };
+}
+
+BENCH( benchJinja2CppLight, renderKernelToSink ) {
+    Template mytemplate( kernelSource() );
+    mytemplate.setValue( "its", 4 );
+    mytemplate.setValue( "offset", 16 );
+    mytemplate.setValue( "scale", 0.5f );
+    mytemplate.setValue( "useBias", 1 );
+    mytemplate.setValue( "bias", 1.5f );
+    mytemplate.compile();
+    while( state.next() ) {
+        CountingSink sink;
+        mytemplate.render( sink );
+        state.keep( sink.bytes );
+    }
+}
+
+// steady state: rendering into the same buffer each time shouldnt allocate
+BENCH( benchJinja2CppLight, renderIntoBuffer ) {
+    string source = "";
+    for( int i = 0; i < 50; i++ ) {
+        source += "{% if useBias %}out[gid] = {{ input }} * {{ weights }} + {{bias}};{% endif %}\n";
+    }
+    Template mytemplate( source );
+    mytemplate.setValue( "useBias", "yes" );
+    mytemplate.setValue( "input", "in[gid]" );
+    mytemplate.setValue( "weights", "w[gid]" );
+    mytemplate.setValue( "bias", "bias[gid % numFilters]" );
+    string buffer;
+    mytemplate.renderInto( buffer );
+    while( state.next() ) {
+        mytemplate.renderInto( buffer );
+        state.keep( buffer.size() );
+    }
+}
+
+// the loop unrolling example from the README, with a third level of nesting
+BENCH( benchJinja2CppLight, renderNestedLoops ) {
+    Template mytemplate( R"DELIM(
+{% for i in range(its) %}a[{{i}}] = image[{{i}}];
+{% for j in range(8) %}b[{{j}}] = image[{{j}}];
+{% for k in range(4) %}c[{{k}}] += b[{{j}}] * a[{{i}}];
+{% endfor %}{% endfor %}{% endfor %}
+)DELIM" );
+    mytemplate.setValue( "its", 64 );
+    string buffer;
+    mytemplate.renderInto( buffer );
+    while( state.next() ) {
+        mytemplate.renderInto( buffer );
+        state.keep( buffer.size() );
+    }
+}
+
+BENCH( benchJinja2CppLight, renderIfHeavy ) {
+    string source = "";
+    for( int i = 0; i < 200; i++ ) {
+        source += "{% if flag" + toString( i % 10 ) + " %}x{% endif %}{% if not flag" + toString( i % 7 ) + " %}y{% endif %}\n";
+    }
+    Template mytemplate( source );
+    for( int i = 0; i < 10; i += 2 ) {
+        mytemplate.setValue( "flag" + toString( i ), 1 );
+    }
+    string buffer;
+    mytemplate.renderInto( buffer );
+    while( state.next() ) {
+        mytemplate.renderInto( buffer );
+        state.keep( buffer.size() );
+    }
+}
+
+namespace {
+    // a few MB of kernels, written to a file once, for the file loading benchmarks
+    const string &largeTemplateFile() {
+        static string path;
+        if( path.size() == 0 ) {
+            path = "benchJinja2CppLight_large.tmp";
+            ofstream file( path.c_str(), ios::binary );
+            const string kernel = kernelSource();
+            for( size_t written = 0; written < ( 4 << 20 ); written += kernel.size() ) {
+                file << kernel;
+            }
+        }
+        return path;
+    }
+    struct RemoveLargeTemplateFile {
+        ~RemoveLargeTemplateFile() {
+            remove( "benchJinja2CppLight_large.tmp" );
+        }
+    } removeLargeTemplateFile;
+}
+
+// the way it had to be done before TemplateSource::mapFile
+BENCH( benchJinja2CppLight, compileFileRead ) {
+    const string &path = largeTemplateFile();
+    while( state.next() ) {
+        ifstream file( path.c_str(), ios::binary );
+        ostringstream contents;
+        contents << file.rdbuf();
+        Template mytemplate( contents.str() );
+        state.keep( mytemplate.compile()->root->sections.size() );
+    }
+}
+
+BENCH( benchJinja2CppLight, compileFileMapped ) {
+    const string &path = largeTemplateFile();
+    while( state.next() ) {
+        Template mytemplate( TemplateSource::mapFile( path ) );
+        state.keep( mytemplate.compile()->root->sections.size() );
+    }
+}
+
+BENCH( benchJinja2CppLight, compileFileStreamed ) {
+    const string &path = largeTemplateFile();
+    while( state.next() ) {
+        ifstream file( path.c_str(), ios::binary );
+        CompiledTemplate compiled( file );
+        state.keep( compiled.root->sections.size() );
+    }
+}
+
+// the same kernel as compileKernel, but loaded from its serialized form
+BENCH( benchJinja2CppLight, loadKernel ) {
+    const shared_ptr< const TemplateSource > blob = TemplateSource::fromString( CompiledTemplate( kernelSource() ).serialize() );
+    state.setBytesProcessed( blob->length );
+    while( state.next() ) {
+        shared_ptr< const CompiledTemplate > compiled = CompiledTemplate::load( blob );
+        state.keep( compiled->root->sections.size() );
+    }
+}
+
+// cold start from a file, compare with compileFileMapped
+BENCH( benchJinja2CppLight, loadFileMapped ) {
+    const string path = largeTemplateFile() + ".j2c";
+    {
+        ifstream file( largeTemplateFile().c_str(), ios::binary );
+        CompiledTemplate compiled( file );
+        ofstream out( path.c_str(), ios::binary );
+        out << compiled.serialize();
+    }
+    while( state.next() ) {
+        shared_ptr< const CompiledTemplate > compiled = CompiledTemplate::load( TemplateSource::mapFile( path ) );
+        state.keep( compiled->root->sections.size() );
+    }
+    state.stop();
+    remove( path.c_str() );
+}
+
+namespace {
+    const int bundleSize = 500;
+    // bundleSize copies of the kernel, named k0, k1, ...
+    const shared_ptr< const TemplateSource > &kernelBundle() {
+        static shared_ptr< const TemplateSource > blob;
+        if( !blob ) {
+            TemplateBundleWriter writer;
+            CompiledTemplate kernel( kernelSource() );
+            for( int i = 0; i < bundleSize; i++ ) {
+                writer.add( "k" + toString( i ), kernel );
+            }
+            blob = TemplateSource::fromString( writer.serialize() );
+        }
+        return blob;
+    }
+}
+
+BENCH( benchJinja2CppLight, bundleFind ) {
+    TemplateBundle bundle( kernelBundle() );
+    vector< string > names;
+    for( int i = 0; i < bundleSize; i++ ) {
+        names.push_back( "k" + toString( i ) );
+    }
+    int i = 0;
+    while( state.next() ) {
+        state.keep( (size_t)bundle.findEntry( names[i] ) );
+        i = ( i + 1 ) % bundleSize;
+    }
+}
+
+BENCH( benchJinja2CppLight, bundleLoad ) {
+    TemplateBundle bundle( kernelBundle() );
+    while( state.next() ) {
+        shared_ptr< const CompiledTemplate > compiled = bundle.load( "k250" );
+        state.keep( compiled->root->sections.size() );
+    }
+}
+
+// the kernel source is already in the cache, so this is just hashing it, and
+// looking it up
+BENCH( benchJinja2CppLight, compileKernelCached ) {
+    const string source = kernelSource();
+    TemplateCache cache;
+    cache.get( source );
+    state.setBytesProcessed( source.size() );
+    while( state.next() ) {
+        state.keep( cache.get( source )->root->sections.size() );
+    }
+}
+
+// as compileAndRenderKernel, but with the parse cached
+BENCH( benchJinja2CppLight, cachedTemplateAndRenderKernel ) {
+    const string source = kernelSource();
+    TemplateCache cache;
+    while( state.next() ) {
+        Template mytemplate( source, cache );
+        mytemplate.setValue( "its", 4 );
+        mytemplate.setValue( "offset", 16 );
+        mytemplate.setValue( "scale", 0.5f );
+        mytemplate.setValue( "useBias", 1 );
+        mytemplate.setValue( "bias", 1.5f );
+        state.keep( mytemplate.render().size() );
+    }
+}
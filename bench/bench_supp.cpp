@@ -0,0 +1,161 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, 
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+
+#include "bench/bench_supp.h"
+
+using namespace std;
+
+namespace bench {
+
+namespace {
+    struct Benchmark {
+        string name;
+        BenchFunction function;
+    };
+    vector<Benchmark> &benchmarks() {
+        static vector<Benchmark> benchmarks;
+        return benchmarks;
+    }
+    volatile size_t keepSink = 0;
+    std::atomic<long long> allocations( 0 );
+    std::atomic<long long> allocatedBytes( 0 );
+}
+
+long long allocationCount() {
+    return allocations.load();
+}
+long long allocatedByteCount() {
+    return allocatedBytes.load();
+}
+
+State::State( long long iterations ) :
+    iterations( iterations ),
+    done( 0 ),
+    started( false ),
+    stopped( false ),
+    startAllocations( 0 ),
+    endAllocations( 0 ),
+    startAllocatedBytes( 0 ),
+    endAllocatedBytes( 0 ),
+    bytesProcessed( 0 ) {
+}
+bool State::next() {
+    if( !started ) {
+        started = true;
+        startAllocations = allocationCount();
+        startAllocatedBytes = allocatedByteCount();
+        startTime = chrono::steady_clock::now();
+    }
+    if( done < iterations ) {
+        done++;
+        return true;
+    }
+    stop();
+    return false;
+}
+void State::stop() {
+    if( !stopped ) {
+        stopped = true;
+        endTime = chrono::steady_clock::now();
+        endAllocations = allocationCount();
+        endAllocatedBytes = allocatedByteCount();
+    }
+}
+void State::setBytesProcessed( long long bytes ) {
+    bytesProcessed = bytes;
+}
+void State::keep( size_t value ) {
+    keepSink = keepSink + value;
+}
+double State::elapsedNs() const {
+    return (double)chrono::duration_cast<chrono::nanoseconds>( endTime - startTime ).count();
+}
+
+long long State::allocations() const {
+    return endAllocations - startAllocations;
+}
+long long State::allocatedBytes() const {
+    return endAllocatedBytes - startAllocatedBytes;
+}
+
+Registrar::Registrar( const char *group, const char *name, BenchFunction function ) {
+    Benchmark benchmark;
+    benchmark.name = string( group ) + "." + name;
+    benchmark.function = function;
+    benchmarks().push_back( benchmark );
+}
+
+}
+
+// count every heap allocation, so benchmarks can report allocations per iteration
+void *operator new( size_t size ) {
+    bench::allocations++;
+    bench::allocatedBytes += size;
+    void *result = malloc( size == 0 ? 1 : size );
+    if( result == 0 ) {
+        throw std::bad_alloc();
+    }
+    return result;
+}
+void operator delete( void *pointer ) noexcept {
+    free( pointer );
+}
+
+// usage: jinja2cpplight_bench [filter]
+// runs every benchmark whose name contains filter
+int main( int argc, char *argv[] ) {
+    string filter = argc > 1 ? argv[1] : "";
+    const double minTimeNs = 200e6;
+    vector<bench::Benchmark> &benchmarks = bench::benchmarks();
+    for( size_t i = 0; i < benchmarks.size(); i++ ) {
+        bench::Benchmark &benchmark = benchmarks[i];
+        if( benchmark.name.find( filter ) == string::npos ) {
+            continue;
+        }
+        long long iterations = 1;
+        double elapsedNs = 0;
+        long long allocations = 0;
+        long long allocatedBytes = 0;
+        long long bytesProcessed = 0;
+        while( true ) {
+            bench::State state( iterations );
+            benchmark.function( state );
+            state.stop();
+            elapsedNs = state.elapsedNs();
+            allocations = state.allocations();
+            allocatedBytes = state.allocatedBytes();
+            bytesProcessed = state.bytesProcessed;
+            if( elapsedNs >= minTimeNs || iterations >= 1000000000LL ) {
+                break;
+            }
+            long long nextIterations = elapsedNs > 0 ? (long long)( iterations * 1.4 * minTimeNs / elapsedNs ) : iterations * 100;
+            if( nextIterations <= iterations ) {
+                nextIterations = iterations + 1;
+            }
+            if( nextIterations > iterations * 100 ) {
+                nextIterations = iterations * 100;
+            }
+            iterations = nextIterations;
+        }
+        cout << left << setw( 60 ) << benchmark.name << right << setw( 14 ) << fixed << setprecision( 1 )
+            << elapsedNs / iterations << " ns/op" << setw( 14 ) << (double)allocatedBytes / iterations << " bytes/op"
+            << setw( 12 ) << setprecision( 2 ) << (double)allocations / iterations << " allocs/op"
+            << setw( 12 ) << iterations << " its";
+        if( bytesProcessed > 0 && elapsedNs > 0 ) {
+            cout << setw( 12 ) << setprecision( 1 ) << bytesProcessed * iterations * 1e3 / elapsedNs << " MB/s";
+        }
+        cout << endl;
+    }
+    return 0;
+}
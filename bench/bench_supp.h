@@ -0,0 +1,75 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, 
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// minimal benchmark harness, in the spirit of gtest:
+//
+//    BENCH( benchJinja2CppLight, render ) {
+//        ... setup, not timed ...
+//        while( state.next() ) {
+//            ... timed ...
+//        }
+//    }
+//
+// each benchmark is re-run with more iterations until it runs for long enough
+// to give a stable time per iteration, which is then reported as ns/op, along
+// with the number of bytes, and of heap allocations, allocated per iteration
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <chrono>
+
+namespace bench {
+
+class State {
+public:
+    State( long long iterations );
+    // returns true while there are iterations left to run; the timer starts
+    // on the first call
+    bool next();
+    // stops the timer, for teardown that shouldn't be measured
+    void stop();
+    // prevents the compiler optimizing away results that are otherwise unused
+    void keep( size_t value );
+    // bytes of input handled by each iteration; when set, throughput is
+    // reported too, in MB/s
+    void setBytesProcessed( long long bytes );
+
+    long long iterations;
+    long long done;
+    bool started;
+    bool stopped;
+    std::chrono::steady_clock::time_point startTime;
+    std::chrono::steady_clock::time_point endTime;
+    long long startAllocations;
+    long long endAllocations;
+    long long startAllocatedBytes;
+    long long endAllocatedBytes;
+    long long bytesProcessed;
+    double elapsedNs() const;
+    long long allocations() const;
+    long long allocatedBytes() const;
+};
+
+// number of calls to operator new so far, in this process, and total bytes requested
+long long allocationCount();
+long long allocatedByteCount();
+
+typedef void (*BenchFunction)( State &state );
+
+class Registrar {
+public:
+    Registrar( const char *group, const char *name, BenchFunction function );
+};
+
+}
+
+#define BENCH( group, name ) \
+    static void bench_##group##_##name( bench::State &state ); \
+    static bench::Registrar benchRegistrar_##group##_##name( #group, #name, bench_##group##_##name ); \
+    static void bench_##group##_##name( bench::State &state )
+
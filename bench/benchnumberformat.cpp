@@ -0,0 +1,76 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, 
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// compares the numberformat functions with the ostringstream-based toString
+
+#include <string>
+#include <cstdio>
+
+#include "bench/bench_supp.h"
+
+#include "stringhelper.h"
+#include "numberformat.h"
+
+using namespace std;
+
+namespace {
+    const int numValues = 1000;
+    float floatValue( int i ) {
+        return i * 1.37f - 300.0f;
+    }
+}
+
+BENCH( benchnumberformat, toStringInt ) {
+    while( state.next() ) {
+        for( int i = 0; i < numValues; i++ ) {
+            state.keep( toString( i * 7919 ).size() );
+        }
+    }
+}
+
+BENCH( benchnumberformat, formatInt ) {
+    char buffer[FORMAT_INT_MAX_CHARS];
+    while( state.next() ) {
+        for( int i = 0; i < numValues; i++ ) {
+            state.keep( formatInt( i * 7919, buffer ) );
+        }
+    }
+}
+
+BENCH( benchnumberformat, toStringFloat ) {
+    while( state.next() ) {
+        for( int i = 0; i < numValues; i++ ) {
+            state.keep( toString( floatValue( i ) ).size() );
+        }
+    }
+}
+
+BENCH( benchnumberformat, formatFloat ) {
+    char buffer[FORMAT_FLOAT_MAX_CHARS];
+    while( state.next() ) {
+        for( int i = 0; i < numValues; i++ ) {
+            state.keep( formatFloat( floatValue( i ), buffer ) );
+        }
+    }
+}
+
+BENCH( benchnumberformat, snprintfFixed ) {
+    char buffer[FORMAT_FLOAT_FIXED_MAX_CHARS + 1];
+    while( state.next() ) {
+        for( int i = 0; i < numValues; i++ ) {
+            state.keep( snprintf( buffer, sizeof( buffer ), "%.3f", floatValue( i ) ) );
+        }
+    }
+}
+
+BENCH( benchnumberformat, formatFloatFixed ) {
+    char buffer[FORMAT_FLOAT_FIXED_MAX_CHARS];
+    while( state.next() ) {
+        for( int i = 0; i < numValues; i++ ) {
+            state.keep( formatFloatFixed( floatValue( i ), 3, buffer ) );
+        }
+    }
+}
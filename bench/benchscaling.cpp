@@ -0,0 +1,103 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, 
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// parse and render time against template, and output, size.  Both should be
+// linear, ie the MB/s column should stay about the same from KB to GB.  The
+// sizes above 64MB take a while, and a few GB of memory, so they only run if
+// JINJA2CPPLIGHT_BENCH_GB is set, eg to 3, for sizes up to 3GB, which takes
+// offsets and outputs past the 2GB that an int can address
+
+#include <string>
+#include <cstdlib>
+#include <map>
+#include <vector>
+#include <memory>
+#include <stdint.h>
+
+#include "bench/bench_supp.h"
+
+#include "Jinja2CppLight.h"
+
+using namespace std;
+using namespace Jinja2CppLight;
+
+namespace {
+    const size_t KB = 1024;
+    const size_t MB = 1024 * KB;
+    const size_t GB = 1024 * MB;
+
+    // kernel-like text, with a substitution every 4KB or so
+    string sourceOfSize( size_t size ) {
+        const string line = "    float sum = in[globalId * 4 + 1] * weights[i] + bias; { out[i] = sum; }\n";
+        string source;
+        source.reserve( size + 4 * KB );
+        while( source.size() < size ) {
+            for( int i = 0; i < 50 && source.size() < size; i++ ) {
+                source += line;
+            }
+            source += "    // {{name}}\n";
+        }
+        return source;
+    }
+
+    void benchParse( bench::State &state, size_t size ) {
+        // shared, so the source isnt copied each time, which would double the memory needed
+        const shared_ptr< const TemplateSource > source = TemplateSource::fromString( sourceOfSize( size ) );
+        state.setBytesProcessed( source->length );
+        while( state.next() ) {
+            CompiledTemplate compiled( source );
+            state.keep( compiled.root->sections.size() );
+        }
+    }
+
+    // a small template, with an output of size bytes
+    void benchRender( bench::State &state, size_t size ) {
+        const string body = "    out[{{i}}] = in[globalId * 4 + 1] * weights[i] + bias; // some comment here\n";
+        CompiledTemplate compiled( "{% for i in range(its) %}" + body + "{% endfor %}" );
+        map< string, Value > values;
+        values["its"] = Value( (int)( size / ( body.size() - 4 ) ) );
+        vector< const Value * > valueBySlot = compiled.slots.bind( values );
+        string buffer;
+        compiled.renderInto( valueBySlot, buffer );
+        state.setBytesProcessed( buffer.size() );
+        while( state.next() ) {
+            compiled.renderInto( valueBySlot, buffer );
+            state.keep( buffer.size() );
+        }
+    }
+
+    template< size_t size >
+    void benchParseSize( bench::State &state ) {
+        benchParse( state, size );
+    }
+    template< size_t size >
+    void benchRenderSize( bench::State &state ) {
+        benchRender( state, size );
+    }
+
+    struct RegisterScalingBenchmarks {
+        RegisterScalingBenchmarks() {
+            bench::Registrar( "benchscaling", "parse1KB", benchParseSize< KB > );
+            bench::Registrar( "benchscaling", "parse1MB", benchParseSize< MB > );
+            bench::Registrar( "benchscaling", "parse64MB", benchParseSize< 64 * MB > );
+            bench::Registrar( "benchscaling", "render1KB", benchRenderSize< KB > );
+            bench::Registrar( "benchscaling", "render1MB", benchRenderSize< MB > );
+            bench::Registrar( "benchscaling", "render64MB", benchRenderSize< 64 * MB > );
+            const char *maxGB = getenv( "JINJA2CPPLIGHT_BENCH_GB" );
+            const int gigabytes = maxGB == 0 ? 0 : atoi( maxGB );
+            if( gigabytes >= 1 ) {
+                bench::Registrar( "benchscaling", "parse1GB", benchParseSize< GB > );
+                bench::Registrar( "benchscaling", "render1GB", benchRenderSize< GB > );
+            }
+#if SIZE_MAX > 0xffffffffu
+            if( gigabytes >= 3 ) {
+                bench::Registrar( "benchscaling", "parse3GB", benchParseSize< 3 * GB > );
+                bench::Registrar( "benchscaling", "render3GB", benchRenderSize< 3 * GB > );
+            }
+#endif
+        }
+    } registerScalingBenchmarks;
+}
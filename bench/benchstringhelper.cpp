@@ -0,0 +1,123 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, 
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <string>
+#include <vector>
+
+#include "bench/bench_supp.h"
+
+#include "stringhelper.h"
+
+using namespace std;
+
+namespace {
+    // roughly what the parser feeds these: template source, and tag contents
+    string sourceText() {
+        string source = "";
+        for( int i = 0; i < 100; i++ ) {
+            source += "out[{{i}}] = image[{{i}} + {{ offset }}] * {{scale}};\n";
+        }
+        return source;
+    }
+}
+
+BENCH( benchstringhelper, split ) {
+    const string source = sourceText();
+    while( state.next() ) {
+        vector<string> splitSource = split( source, "{{" );
+        state.keep( splitSource.size() );
+    }
+}
+
+BENCH( benchstringhelper, splitTag ) {
+    const string tag = "for i in range(its)";
+    while( state.next() ) {
+        vector<string> splitTag = split( tag, " " );
+        state.keep( splitTag.size() );
+    }
+}
+
+BENCH( benchstringhelper, trim ) {
+    const string tag = "   for i in range(its)  \n";
+    while( state.next() ) {
+        state.keep( trim( tag ).size() );
+    }
+}
+
+BENCH( benchstringhelper, replaceGlobal ) {
+    const string source = sourceText();
+    while( state.next() ) {
+        state.keep( replaceGlobal( source, " ", "" ).size() );
+    }
+}
+
+BENCH( benchstringhelper, replaceGlobalTag ) {
+    const string tag = "{% endfor %}";
+    while( state.next() ) {
+        state.keep( replaceGlobal( tag, " ", "" ).size() );
+    }
+}
+
+BENCH( benchstringhelper, splitIterator ) {
+    const string source = sourceText();
+    while( state.next() ) {
+        SplitIterator pieces( source, "{{" );
+        StringRef piece;
+        size_t count = 0;
+        while( pieces.next( piece ) ) {
+            count++;
+        }
+        state.keep( count );
+    }
+}
+
+BENCH( benchstringhelper, splitIteratorTag ) {
+    const string tag = "for i in range(its)";
+    while( state.next() ) {
+        SplitIterator words( tag, " " );
+        StringRef word;
+        size_t count = 0;
+        while( words.next( word ) ) {
+            count++;
+        }
+        state.keep( count );
+    }
+}
+
+BENCH( benchstringhelper, trimRef ) {
+    const string tag = "   for i in range(its)  \n";
+    while( state.next() ) {
+        state.keep( trimRef( tag ).size() );
+    }
+}
+
+BENCH( benchstringhelper, replaceGlobalAppend ) {
+    const string source = sourceText();
+    string result;
+    while( state.next() ) {
+        result.clear();
+        replaceGlobalAppend( result, source, " ", "" );
+        state.keep( result.size() );
+    }
+}
+
+BENCH( benchstringhelper, replaceGlobalInPlaceTag ) {
+    const string tag = "{% endfor %}";
+    string buffer;
+    while( state.next() ) {
+        buffer = tag;
+        replaceGlobalInPlace( buffer, " ", "" );
+        state.keep( buffer.size() );
+    }
+}
+
+BENCH( benchstringhelper, hashString ) {
+    const string source = sourceText();
+    state.setBytesProcessed( source.size() );
+    while( state.next() ) {
+        state.keep( (size_t)hashString( source ) );
+    }
+}
@@ -0,0 +1,77 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, 
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// scanning a multi-megabyte source for tags, with each implementation, and
+// compiling it
+
+#include <string>
+
+#include "bench/bench_supp.h"
+
+#include "tagscan.h"
+#include "Jinja2CppLight.h"
+
+using namespace std;
+using namespace Jinja2CppLight;
+
+namespace {
+    // about 4MB of kernel-like code, with a substitution every 4KB or so
+    const string &largeSource() {
+        static string source;
+        if( source.size() == 0 ) {
+            const string line = "    float sum = in[globalId * 4 + 1] * weights[i] + bias; { out[i] = sum; }\n";
+            while( source.size() < ( 4 << 20 ) ) {
+                for( int i = 0; i < 50; i++ ) {
+                    source += line;
+                }
+                source += "    // {{name}}\n";
+            }
+        }
+        return source;
+    }
+
+    void benchScan( bench::State &state, size_t (*find)( const char *data, size_t length, size_t from ) ) {
+        const string &source = largeSource();
+        state.setBytesProcessed( source.size() );
+        while( state.next() ) {
+            size_t tags = 0;
+            size_t pos = find( source.data(), source.size(), 0 );
+            while( pos < source.size() ) {
+                tags++;
+                pos = find( source.data(), source.size(), pos + 2 );
+            }
+            state.keep( tags );
+        }
+    }
+}
+
+BENCH( benchtagscan, scanPortable ) {
+    benchScan( state, findTagStartPortable );
+}
+
+#ifdef JINJA2CPPLIGHT_TAGSCAN_X86
+BENCH( benchtagscan, scanSse2 ) {
+    benchScan( state, findTagStartSse2 );
+}
+
+BENCH( benchtagscan, scanAvx2 ) {
+    if( !tagScanHasAvx2() ) {
+        // keeps the report lined up; the number is sse2's
+        benchScan( state, findTagStartSse2 );
+        return;
+    }
+    benchScan( state, findTagStartAvx2 );
+}
+#endif
+
+BENCH( benchtagscan, compileLargeSource ) {
+    const string &source = largeSource();
+    state.setBytesProcessed( source.size() );
+    while( state.next() ) {
+        CompiledTemplate compiled( source );
+        state.keep( compiled.root->sections.size() );
+    }
+}
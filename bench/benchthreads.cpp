@@ -0,0 +1,228 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// renders one shared CompiledTemplate from 1, 2, 4, ... threads at once, up
+// to the number of cores, each thread with its own Context and buffer.  Each
+// iteration, every thread renders the template once, and the MB/s column is
+// the output of one thread, ie the throughput per core, so it should stay
+// about the same as the number of threads goes up.
+//
+// renderLoop* render one template with a 200,000 iteration loop, on one
+// thread, then split over a ThreadPool with one thread per core, which should
+// be faster by up to the number of cores.
+//
+// batch* render one kernel template with 256 different sets of values, first
+// by constructing a Template per set, as an application would without the
+// batch api, then with a BatchRenderer
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "bench/bench_supp.h"
+
+#include "Jinja2CppLight.h"
+#include "threadpool.h"
+
+using namespace std;
+using namespace Jinja2CppLight;
+
+namespace {
+    const char *kernelSource =
+        "{% for i in range(its) %}"
+        "    out[{{i}}] = in[globalId * {{stride}} + 1] * weights[{{i}}] + {{bias}}; // some comment here\n"
+        "{% if unrolled %}    sum += out[{{i}}];\n{% endif %}"
+        "{% endfor %}";
+
+    // worker threads that each render once per round, so the threads are
+    // only started once per benchmark run, not once per iteration
+    class RenderThreads {
+    public:
+        RenderThreads( const CompiledTemplate &compiled, int numThreads ) :
+            compiled( compiled ),
+            round( 0 ),
+            finished( 0 ),
+            stopping( false ),
+            bytesRendered( numThreads, 0 ) {
+            for( int i = 0; i < numThreads; i++ ) {
+                threads.push_back( thread( &RenderThreads::run, this, i ) );
+            }
+        }
+        ~RenderThreads() {
+            {
+                lock_guard< mutex > lock( mutex_ );
+                stopping = true;
+            }
+            started.notify_all();
+            for( size_t i = 0; i < threads.size(); i++ ) {
+                threads[i].join();
+            }
+        }
+        // every thread renders once; returns once they all have
+        void renderRound() {
+            unique_lock< mutex > lock( mutex_ );
+            finished = 0;
+            round++;
+            started.notify_all();
+            while( finished < (int)threads.size() ) {
+                done.wait( lock );
+            }
+        }
+        size_t bytesPerThread() const {
+            return bytesRendered[0];
+        }
+    private:
+        void run( int index ) {
+            Context context( compiled );
+            context.setValue( "its", 1000 );
+            context.setValue( "stride", 4 + index );
+            context.setValue( "bias", 0.5f );
+            context.setValue( "unrolled", 1 );
+            string buffer;
+            long long lastRound = 0;
+            while( true ) {
+                {
+                    unique_lock< mutex > lock( mutex_ );
+                    while( round == lastRound && !stopping ) {
+                        started.wait( lock );
+                    }
+                    if( stopping ) {
+                        return;
+                    }
+                    lastRound = round;
+                }
+                context.renderInto( buffer );
+                bytesRendered[index] = buffer.size();
+                {
+                    lock_guard< mutex > lock( mutex_ );
+                    finished++;
+                }
+                done.notify_one();
+            }
+        }
+
+        const CompiledTemplate &compiled;
+        mutex mutex_;
+        condition_variable started;
+        condition_variable done;
+        long long round;
+        int finished;
+        bool stopping;
+        vector< size_t > bytesRendered;
+        vector< thread > threads;
+    };
+
+    void benchRenderThreads( bench::State &state, int numThreads ) {
+        const CompiledTemplate compiled( kernelSource );
+        RenderThreads threads( compiled, numThreads );
+        threads.renderRound();
+        state.setBytesProcessed( threads.bytesPerThread() );
+        while( state.next() ) {
+            threads.renderRound();
+        }
+    }
+
+    template< int numThreads >
+    void benchRenderThreadsCount( bench::State &state ) {
+        benchRenderThreads( state, numThreads );
+    }
+
+    void benchRenderLoop( bench::State &state, ThreadPool *pool ) {
+        const CompiledTemplate compiled( kernelSource );
+        Context context( compiled );
+        context.setValue( "its", 200000 );
+        context.setValue( "stride", 4 );
+        context.setValue( "bias", 0.5f );
+        context.setValue( "unrolled", 1 );
+        context.setParallelLoops( pool, 10000 );
+        string buffer;
+        context.renderInto( buffer );
+        state.setBytesProcessed( buffer.size() );
+        while( state.next() ) {
+            context.renderInto( buffer );
+            state.keep( buffer.size() );
+        }
+    }
+
+    const int batchSize = 256;
+
+    void setKernelValues( Context &context, int i ) {
+        context.setValue( "its", 8 + i % 16 );
+        context.setValue( "stride", i );
+        context.setValue( "bias", 0.25f * i, 2 );
+        context.setValue( "unrolled", 1 );
+    }
+
+    struct RegisterThreadBenchmarks {
+        RegisterThreadBenchmarks() {
+            const int cores = (int)thread::hardware_concurrency();
+            bench::Registrar( "benchthreads", "render1Thread", benchRenderThreadsCount< 1 > );
+            if( cores >= 2 ) bench::Registrar( "benchthreads", "render2Threads", benchRenderThreadsCount< 2 > );
+            if( cores >= 4 ) bench::Registrar( "benchthreads", "render4Threads", benchRenderThreadsCount< 4 > );
+            if( cores >= 8 ) bench::Registrar( "benchthreads", "render8Threads", benchRenderThreadsCount< 8 > );
+            if( cores >= 16 ) bench::Registrar( "benchthreads", "render16Threads", benchRenderThreadsCount< 16 > );
+            if( cores >= 32 ) bench::Registrar( "benchthreads", "render32Threads", benchRenderThreadsCount< 32 > );
+            if( cores >= 64 ) bench::Registrar( "benchthreads", "render64Threads", benchRenderThreadsCount< 64 > );
+            if( cores >= 128 ) bench::Registrar( "benchthreads", "render128Threads", benchRenderThreadsCount< 128 > );
+        }
+    } registerThreadBenchmarks;
+}
+
+BENCH( benchthreads, renderLoopSerial ) {
+    benchRenderLoop( state, 0 );
+}
+
+BENCH( benchthreads, renderLoopParallel ) {
+    ThreadPool pool;
+    benchRenderLoop( state, &pool );
+}
+
+BENCH( benchthreads, batchTemplatePerItem ) {
+    size_t bytes = 0;
+    while( state.next() ) {
+        for( int i = 0; i < batchSize; i++ ) {
+            Template mytemplate( kernelSource );
+            mytemplate.setValue( "its", 8 + i % 16 );
+            mytemplate.setValue( "stride", i );
+            mytemplate.setValue( "bias", 0.25f * i, 2 );
+            mytemplate.setValue( "unrolled", 1 );
+            bytes += mytemplate.render().size();
+        }
+    }
+    state.keep( bytes );
+}
+
+BENCH( benchthreads, batchRender ) {
+    const CompiledTemplate compiled( kernelSource );
+    vector< Context > contexts;
+    for( int i = 0; i < batchSize; i++ ) {
+        contexts.push_back( Context( compiled ) );
+        setKernelValues( contexts.back(), i );
+    }
+    BatchRenderer renderer;
+    vector< string > outputs;
+    renderer.render( contexts, outputs );
+    while( state.next() ) {
+        renderer.render( contexts, outputs );
+        state.keep( outputs.back().size() );
+    }
+}
+
+BENCH( benchthreads, batchRenderFreshOutputs ) {
+    const CompiledTemplate compiled( kernelSource );
+    vector< Context > contexts;
+    for( int i = 0; i < batchSize; i++ ) {
+        contexts.push_back( Context( compiled ) );
+        setKernelValues( contexts.back(), i );
+    }
+    BatchRenderer renderer;
+    while( state.next() ) {
+        vector< string > outputs = renderer.render( contexts );
+        state.keep( outputs.back().size() );
+    }
+}
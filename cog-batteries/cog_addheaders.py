@@ -13,10 +13,15 @@
 #    // [[[end]]]
 #
 # ... and run cog on the header file, to generate the header declarations
+#
+# the declarations are read from the .cpp file with the same name as the
+# header, or from cppfile, a path relative to the header, eg for a class
+# whose definitions are kept in a .cpp file of their own
 
+import os
 import cog
 
-def add( classname = ''):
+def add( classname = '', cppfile = '' ):
 #    debug = open('debug.txt', 'a' )
 #    debug.write( 'foo\n')
 #    debug.write( 'infile [' + cog.inFile + ']\n' )
@@ -26,7 +31,10 @@ def add( classname = ''):
     infilename = splitinfile[ len(splitinfile) - 1 ]
     if classname == '':
         classname = infilename.replace('.h','')
-    cppfile = infile.replace('.h','.cpp')
+    if cppfile == '':
+        cppfile = infile.replace('.h','.cpp')
+    else:
+        cppfile = os.path.join( os.path.dirname( infile ), cppfile )
     # cog.outl( '// classname: ' + classname )
     # cog.outl( '// cppfile: ' + infilename.replace('.h','.cpp' ) )
     f = open( cppfile, 'r')
@@ -0,0 +1,39 @@
+# Copyright Hugh Perkins 2015 hughperkins at gmail
+#
+# This Source Code Form is subject to the terms of the Mozilla Public License, 
+# v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+# obtain one at http://mozilla.org/MPL/2.0/.
+#
+# like stringify.py, but embeds templates already compiled, rather than their
+# source, so they dont need parsing at runtime, and parse errors show up when
+# cog runs, rather than at the first render.  In a .cpp file that includes
+# Jinja2CppLight.h:
+#
+#    // [[[cog
+#    // import cog_precompile
+#    // cog_precompile.write_bundle( 'kernels', [ 'cl/conv.cl', 'cl/pool.cl' ] )
+#    // ]]]
+#    // [[[end]]]
+#
+# ... and run cog on the file.  This defines
+#
+#    const Jinja2CppLight::TemplateBundle &kernels();
+#
+# with each template named after its file, without the directory, or pass
+# 'name=path' to choose the name.  Paths are relative to the directory cog
+# runs in.  The precompiler is jinja2cpplight_precompile, built with
+# Jinja2CppLight; set JINJA2CPPLIGHT_PRECOMPILE to its path, if it isnt on
+# the PATH
+
+import os
+import subprocess
+import cog
+
+def write_bundle( name, templates ):
+    precompile = os.environ.get( 'JINJA2CPPLIGHT_PRECOMPILE', 'jinja2cpplight_precompile' )
+    process = subprocess.Popen( [ precompile, '-', name ] + templates,
+        stdout = subprocess.PIPE, stderr = subprocess.PIPE )
+    out, err = process.communicate()
+    if process.returncode != 0:
+        cog.error( 'jinja2cpplight_precompile failed: ' + err.decode( 'utf-8', 'replace' ).strip() )
+    cog.out( out.decode( 'utf-8' ) )
@@ -9,8 +9,25 @@
 #include <map>
 #include <vector>
 #include <sstream>
+#include <utility>
+#include <exception>
+#include <cstring>
+#include <stdint.h>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include "stringhelper.h"
+#include "tagscan.h"
+#include "threadpool.h"
+#include "templatecache.h"
 
 #include "Jinja2CppLight.h"
 
@@ -30,10 +47,298 @@ namespace Jinja2CppLight {
 #undef STATIC
 #define STATIC
 
+Value::Value() :
+    type( Undefined ),
+    floatPrecision( -1 ),
+    length( 0 ) {
+}
+Value::Value( int value ) :
+    type( Int ),
+    floatPrecision( -1 ),
+    length( 0 ) {
+    intValue = value;
+}
+Value::Value( float value ) :
+    type( Float ),
+    floatPrecision( -1 ),
+    length( 0 ) {
+    floatValue = value;
+}
+Value::Value( float value, int precision ) :
+    type( Float ),
+    floatPrecision( precision ),
+    length( 0 ) {
+    floatValue = value;
+}
+Value::Value( const std::string &value ) :
+    type( Undefined ),
+    floatPrecision( -1 ),
+    length( 0 ) {
+    setString( value.data(), value.length() );
+}
+Value::Value( const char *data, size_t length ) :
+    type( Undefined ),
+    floatPrecision( -1 ),
+    length( 0 ) {
+    setString( data, length );
+}
+Value::Value( const Value &other ) :
+    type( Undefined ),
+    floatPrecision( -1 ),
+    length( 0 ) {
+    *this = other;
+}
+Value &Value::operator=( const Value &other ) {
+    if( this == &other ) {
+        return *this;
+    }
+    switch( other.type ) {
+        case Int:
+            setInt( other.intValue );
+            break;
+        case Float:
+            setFloat( other.floatValue, other.floatPrecision );
+            break;
+        case String:
+            setString( other.getStringData(), other.length );
+            break;
+        default:
+            clear();
+            break;
+    }
+    return *this;
+}
+Value::~Value() {
+    clear();
+}
+void Value::setInt( int value ) {
+    clear();
+    type = Int;
+    intValue = value;
+}
+void Value::setFloat( float value, int precision ) {
+    clear();
+    type = Float;
+    floatValue = value;
+    floatPrecision = precision;
+}
+void Value::setString( const char *data, size_t length ) {
+    clear();
+    if( length <= InlineCapacity ) {
+        memcpy( inlineString, data, length );
+    } else {
+        heapString = new char[length];
+        memcpy( heapString, data, length );
+    }
+    this->type = String;
+    this->length = length;
+}
+void Value::clear() {
+    if( type == String && length > InlineCapacity ) {
+        delete[] heapString;
+    }
+    type = Undefined;
+    floatPrecision = -1;
+    length = 0;
+}
+
+namespace {
+    class StringTemplateSource : public TemplateSource {
+    public:
+        std::string sourceCode;
+        StringTemplateSource( std::string sourceCode ) :
+            sourceCode( std::move( sourceCode ) ) {
+            data = this->sourceCode.data();
+            length = this->sourceCode.length();
+        }
+    };
+
+    // the file stays mapped until the last template using it is destroyed
+    class MappedTemplateSource : public TemplateSource {
+    public:
+#ifdef _WIN32
+        HANDLE file;
+        HANDLE mapping;
+#endif
+        void *view;
+        size_t viewLength;
+
+        MappedTemplateSource( const std::string &path ) :
+#ifdef _WIN32
+            file( INVALID_HANDLE_VALUE ),
+            mapping( 0 ),
+#endif
+            view( 0 ),
+            viewLength( 0 ) {
+#ifdef _WIN32
+            file = CreateFileA( path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0 );
+            if( file == INVALID_HANDLE_VALUE ) {
+                throw std::runtime_error( "couldnt open template file " + path );
+            }
+            LARGE_INTEGER fileSize;
+            if( !GetFileSizeEx( file, &fileSize ) ) {
+                CloseHandle( file );
+                throw std::runtime_error( "couldnt get size of template file " + path );
+            }
+            viewLength = (size_t)fileSize.QuadPart;
+            if( viewLength > 0 ) {
+                mapping = CreateFileMappingA( file, 0, PAGE_READONLY, 0, 0, 0 );
+                if( mapping != 0 ) {
+                    view = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+                }
+                if( view == 0 ) {
+                    if( mapping != 0 ) {
+                        CloseHandle( mapping );
+                    }
+                    CloseHandle( file );
+                    throw std::runtime_error( "couldnt map template file " + path );
+                }
+            }
+#else
+            int fd = open( path.c_str(), O_RDONLY );
+            if( fd < 0 ) {
+                throw std::runtime_error( "couldnt open template file " + path );
+            }
+            struct stat fileStat;
+            if( fstat( fd, &fileStat ) != 0 ) {
+                close( fd );
+                throw std::runtime_error( "couldnt get size of template file " + path );
+            }
+            viewLength = (size_t)fileStat.st_size;
+            // mmap doesnt accept a length of zero; an empty file is just an empty template
+            if( viewLength > 0 ) {
+                view = mmap( 0, viewLength, PROT_READ, MAP_PRIVATE, fd, 0 );
+                if( view == MAP_FAILED ) {
+                    view = 0;
+                    close( fd );
+                    throw std::runtime_error( "couldnt map template file " + path );
+                }
+            }
+            close( fd ); // the mapping keeps the file open
+#endif
+            if( view != 0 ) {
+                data = (const char *)view;
+                length = viewLength;
+            }
+        }
+        virtual ~MappedTemplateSource() {
+#ifdef _WIN32
+            if( view != 0 ) {
+                UnmapViewOfFile( view );
+                CloseHandle( mapping );
+            }
+            CloseHandle( file );
+#else
+            if( view != 0 ) {
+                munmap( view, viewLength );
+            }
+#endif
+        }
+    };
+}
+
+ChunkedTemplateInput::ChunkedTemplateInput( ReadCallback read, void *userData, size_t chunkSize ) :
+    read( read ),
+    userData( userData ),
+    chunkSize( chunkSize > 0 ? chunkSize : 1 ) {
+}
+// appends the next chunk to text; returns false once there is no more.  Reads
+// into text's spare capacity first, if it has any, eg reserved for a stream of
+// known size, so that text only grows when it is full
+bool ChunkedTemplateInput::readMore() {
+    const size_t oldSize = text.size();
+    const size_t spare = text.capacity() - oldSize;
+    const size_t size = spare > 0 && spare < chunkSize ? spare : chunkSize;
+    text.resize( oldSize + size );
+    const size_t readSize = read( userData, &text[oldSize], size );
+    text.resize( oldSize + readSize );
+    return readSize > 0;
+}
+
+STATIC std::shared_ptr< const TemplateSource > TemplateSource::fromString( std::string sourceCode ) {
+    return std::make_shared< StringTemplateSource >( std::move( sourceCode ) );
+}
+STATIC std::shared_ptr< const TemplateSource > TemplateSource::mapFile( const std::string &path ) {
+    return std::make_shared< MappedTemplateSource >( path );
+}
+namespace {
+    class StaticTemplateSource : public TemplateSource {
+    public:
+        StaticTemplateSource( const char *data, size_t length ) {
+            this->data = data;
+            this->length = length;
+        }
+    };
+}
+STATIC std::shared_ptr< const TemplateSource > TemplateSource::fromStatic( const char *data, size_t length ) {
+    return std::make_shared< StaticTemplateSource >( data, length );
+}
+namespace {
+    class SliceTemplateSource : public TemplateSource {
+    public:
+        std::shared_ptr< const TemplateSource > owner;
+        SliceTemplateSource( std::shared_ptr< const TemplateSource > owner, size_t offset, size_t length ) :
+            owner( owner ) {
+            data = owner->data + offset;
+            this->length = length;
+        }
+    };
+}
+STATIC std::shared_ptr< const TemplateSource > TemplateSource::slice( std::shared_ptr< const TemplateSource > owner, size_t offset, size_t length ) {
+    if( offset > owner->length || length > owner->length - offset ) {
+        throw std::out_of_range( "TemplateSource::slice out of range" );
+    }
+    return std::make_shared< SliceTemplateSource >( owner, offset, length );
+}
+
+int SlotTable::intern( const std::string &name ) {
+    map< string, int >::iterator it = slotByName.find( name );
+    if( it != slotByName.end() ) {
+        return it->second;
+    }
+    int slot = (int)names.size();
+    names.push_back( name );
+    slotByName[ name ] = slot;
+    return slot;
+}
+// returns -1 if name has no slot, ie the template doesnt use it
+int SlotTable::find( const std::string &name ) const {
+    map< string, int >::const_iterator it = slotByName.find( name );
+    if( it == slotByName.end() ) {
+        return -1;
+    }
+    return it->second;
+}
+int SlotTable::size() const {
+    return (int)names.size();
+}
+std::vector< const Value * > SlotTable::bind( const std::map< std::string, Value > &valueByName ) const {
+    vector< const Value * > valueBySlot( names.size(), (const Value *)0 );
+    for( int slot = 0; slot < (int)names.size(); slot++ ) {
+        map< string, Value >::const_iterator it = valueByName.find( names[slot] );
+        if( it != valueByName.end() ) {
+            valueBySlot[slot] = &it->second;
+        }
+    }
+    return valueBySlot;
+}
+
 Template::Template( std::string sourceCode ) :
-    sourceCode( sourceCode ) {
-    root = new Root();
-//    cout << "template::Template root: "  << root << endl;
+    source( TemplateSource::fromString( std::move( sourceCode ) ) ),
+    cache( 0 ),
+    context( 0 ) {
+}
+Template::Template( std::shared_ptr< const TemplateSource > source ) :
+    source( source ),
+    cache( 0 ),
+    context( 0 ) {
+}
+// gets the compiled template from cache, eg TemplateCache::global(), so that
+// only the first Template with this source parses it
+Template::Template( std::string sourceCode, TemplateCache &cache ) :
+    source( TemplateSource::fromString( std::move( sourceCode ) ) ),
+    cache( &cache ),
+    context( 0 ) {
 }    
 
 STATIC bool Template::isNumber( std::string astring, int *p_value ) {
@@ -46,275 +351,481 @@ STATIC bool Template::isNumber( std::string astring, int *p_value ) {
     return false;
 }
 VIRTUAL Template::~Template() {
-    for( map< string, Value * >::iterator it = valueByName.begin(); it != valueByName.end(); it++ ) {
-        delete it->second;
-    }
-    valueByName.clear();
-    delete root;
+    delete context;
 }
 Template &Template::setValue( std::string name, int value ) {
-    IntValue *intValue = new IntValue( value );
-    valueByName[ name ] = intValue;
-    return *this;
+    return storeValue( name, Value( value ) );
 }
 Template &Template::setValue( std::string name, float value ) {
-    FloatValue *floatValue = new FloatValue( value );
-    valueByName[ name ] = floatValue;
-    return *this;
+    return storeValue( name, Value( value ) );
+}
+// renders value with precision decimal places
+Template &Template::setValue( std::string name, float value, int precision ) {
+    return storeValue( name, Value( value, precision ) );
 }
 Template &Template::setValue( std::string name, std::string value ) {
-    StringValue *floatValue = new StringValue( value );
-    valueByName[ name ] = floatValue;
+    return storeValue( name, Value( value ) );
+}
+Template &Template::storeValue( std::string name, const Value &value ) {
+    if( context != 0 ) {
+        context->storeValue( name, value );
+    } else {
+        valueByName[ name ] = value;
+    }
     return *this;
 }
+// parses source, the first time it is called; after that, just returns the
+// existing compiled template.  Values set so far move into context
+const CompiledTemplate *Template::compile() {
+    if( compiled == 0 ) {
+        if( cache != 0 ) {
+            compiled = cache->get( source );
+        } else {
+            compiled = std::make_shared< CompiledTemplate >( source );
+        }
+        context = new Context( *compiled );
+        context->valueByName.swap( valueByName );
+        context->bind();
+    }
+    return compiled.get();
+}
 std::string Template::render() {
 //    cout << "tempalte::render root=" << root << endl;
-    size_t finalPos = eatSection(0, root );
-//    cout << finalPos << " vs " << sourceCode.length() << endl;
-    if( finalPos != sourceCode.length() ) {
-        root->print("");
-        throw render_error("some sourcecode found at end: " + sourceCode.substr( finalPos ) );
+    compile();
+    return context->render();
+}
+void Template::render( OutputSink &out ) {
+    compile();
+    context->render( out );
+}
+void Template::render( std::ostream &out ) {
+    compile();
+    context->render( out );
+}
+void Template::renderInto( std::string &buffer ) {
+    compile();
+    context->renderInto( buffer );
+}
+
+Context::Context( const CompiledTemplate &compiled ) :
+    compiled( &compiled ),
+    valueBySlot( compiled.slots.size(), (const Value *)0 ),
+    outputSizeHint( 0 ) {
+}
+// copies other's values, eg to give each thread its own copy of some common values
+Context::Context( const Context &other ) :
+    compiled( other.compiled ),
+    valueByName( other.valueByName ),
+    outputSizeHint( other.outputSizeHint ),
+    options( other.options ) {
+    bind();
+}
+Context &Context::operator=( const Context &other ) {
+    if( this != &other ) {
+        compiled = other.compiled;
+        valueByName = other.valueByName;
+        outputSizeHint = other.outputSizeHint;
+        options = other.options;
+        bind();
+    }
+    return *this;
+}
+Context &Context::setValue( std::string name, int value ) {
+    return storeValue( name, Value( value ) );
+}
+Context &Context::setValue( std::string name, float value ) {
+    return storeValue( name, Value( value ) );
+}
+// renders value with precision decimal places
+Context &Context::setValue( std::string name, float value, int precision ) {
+    return storeValue( name, Value( value, precision ) );
+}
+Context &Context::setValue( std::string name, std::string value ) {
+    return storeValue( name, Value( value ) );
+}
+Context &Context::storeValue( std::string name, const Value &value ) {
+    Value &storedValue = valueByName[ name ];
+    storedValue = value;
+    int slot = compiled->slots.find( name );
+    if( slot >= 0 ) {
+        valueBySlot[slot] = &storedValue;
+    }
+    return *this;
+}
+// renders large for loops on pool, see RenderOptions.  pool isnt owned, and
+// can be shared by many contexts.  Pass a null pool to render serially again
+Context &Context::setParallelLoops( ThreadPool *pool, int minIterations ) {
+    options.pool = pool;
+    options.parallelLoopMinIterations = minIterations;
+    return *this;
+}
+// points valueBySlot at the values in valueByName
+void Context::bind() {
+    valueBySlot = compiled->slots.bind( valueByName );
+}
+std::string Context::render() {
+    std::string result = "";
+    renderInto( result );
+    return result;
+}
+void Context::render( OutputSink &out ) {
+    compiled->render( valueBySlot, out, options );
+}
+void Context::render( std::ostream &out ) {
+    StreamSink sink( out );
+    compiled->render( valueBySlot, sink, options );
+}
+// like CompiledTemplate::renderInto, but also reserves buffer up front to
+// the largest output rendered so far with this context
+void Context::renderInto( std::string &buffer ) {
+    if( buffer.capacity() < outputSizeHint ) {
+        buffer.reserve( outputSizeHint );
+    }
+    compiled->renderInto( valueBySlot, buffer, options );
+    if( buffer.size() > outputSizeHint ) {
+        outputSizeHint = buffer.size();
     }
-//    cout << "tempalte::render root=" << root << endl;
-//    root->print("");
-//    cout << "tempalte::render root=" << root << endl;
-    return root->render(valueByName);
+}
+
+// one thread per core
+BatchRenderer::BatchRenderer() :
+    BatchRenderer( ThreadPool::defaultThreadCount() ) {
+}
+// numThreads besides the calling thread, which renders too, so with 0,
+// everything renders on the calling thread.  Throws std::invalid_argument if
+// numThreads is negative
+BatchRenderer::BatchRenderer( int numThreads ) :
+    pool( 0 ) {
+    if( numThreads < 0 ) {
+        throw std::invalid_argument( "BatchRenderer needs 0 or more threads, not " + toString( numThreads ) );
+    }
+    pool = new ThreadPool( numThreads );
+    scratch.resize( numThreads + 1 );
+}
+BatchRenderer::~BatchRenderer() {
+    delete pool;
+}
+// returns the output of each context, in the same order as contexts
+std::vector< std::string > BatchRenderer::render( std::vector< Context > &contexts ) {
+    std::vector< std::string > outputs;
+    render( contexts, outputs );
+    return outputs;
+}
+// resizes outputs to one per context, and replaces each with the output of
+// the corresponding context, keeping its capacity.  If any render throws,
+// the others still run, and then the error from the first is rethrown
+void BatchRenderer::render( std::vector< Context > &contexts, std::vector< std::string > &outputs ) {
+    outputs.resize( contexts.size() );
+    pool->parallelForWorker( contexts.size(), [this, &contexts, &outputs]( size_t i, int worker ) {
+        std::string &buffer = scratch[worker];
+        contexts[i].renderInto( buffer );
+        outputs[i].assign( buffer.data(), buffer.size() );
+    } );
 }
 
 void Template::print(ControlSection *section) {
     section->print("");
 }
 
-// pos should point to the first character that has sourcecode inside the control section controlSection
-// return value should be first character of the control section end part (ie first char of {% endfor %} type bit)
-int Template::eatSection( int pos, ControlSection *controlSection ) {
-//    int pos = 0;
-//    vector<string> tokenStack;
-//    string updatedString = "";
-    while( true ) {
-//        cout << "pos: " << pos << endl;
-        size_t controlChangeBegin = sourceCode.find( "{%", pos );
-//        cout << "controlChangeBegin: " << controlChangeBegin << endl;
-        if( controlChangeBegin == string::npos ) {
-            //updatedString += doSubstitutions( sourceCode.substr( pos ), valueByName );
-            Code *code = new Code();
-            code->startPos = pos;
-            code->endPos = sourceCode.length();
-//            code->templateCode = sourceCode.substr( pos, sourceCode.length() - pos );
-            code->templateCode = sourceCode.substr( code->startPos, code->endPos - code->startPos );
-            controlSection->sections.push_back( code );
-            return sourceCode.length();
+namespace {
+    bool isSpace( char c ) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+    // the {{ }} tag starting at tagStart: sets *nameStart and *nameEnd to the
+    // variable name, trimmed, and returns the position after the }}, or npos
+    // if there is no }}.  Anything after a | is a filter, which we dont
+    // support yet, so is ignored
+    size_t findVariable( StringRef source, size_t tagStart, size_t *nameStart, size_t *nameEnd ) {
+        const size_t tagEnd = source.find( "}}", tagStart + 2 );
+        if( tagEnd == StringRef::npos ) {
+            return StringRef::npos;
+        }
+        size_t start = tagStart + 2;
+        size_t end = start;
+        while( end < tagEnd && source[end] != '|' ) {
+            end++;
+        }
+        while( start < end && isSpace( source[start] ) ) {
+            start++;
+        }
+        while( end > start && isSpace( source[end - 1] ) ) {
+            end--;
+        }
+        *nameStart = start;
+        *nameEnd = end;
+        return tagEnd + 2;
+    }
+}
+
+TemplateLexer::TemplateLexer( StringRef source, bool complete ) :
+    source( source ),
+    complete( complete ),
+    pos( 0 ),
+    inBlock( false ),
+    blockStart( 0 ) {
+}
+// returns the position of the next {{ or {% at or after from, or the length
+// of the source, if there are none.  Braces before a tag are text, eg the
+// first { of {{%
+size_t TemplateLexer::findTagStart( size_t from ) {
+    return ::findTagStart( source.data, source.length, from );
+}
+Token TemplateLexer::next() {
+    const size_t length = source.length;
+    Token token;
+    if( inBlock ) {
+        while( pos < length && isSpace( source[pos] ) ) {
+            pos++;
+        }
+        if( pos >= length ) {
+            throw render_error( "control section unterminated: " + source.substr( blockStart, 40 ).str() );
+        }
+        token.start = pos;
+        if( source[pos] == '%' && pos + 1 < length && source[pos + 1] == '}' ) {
+            token.type = Token::BlockEnd;
+            token.length = 2;
+            inBlock = false;
+        } else if( source[pos] == '(' ) {
+            token.type = Token::LeftParen;
+            token.length = 1;
+        } else if( source[pos] == ')' ) {
+            token.type = Token::RightParen;
+            token.length = 1;
         } else {
-            size_t controlChangeEnd = sourceCode.find( "%}", controlChangeBegin );
-            if( controlChangeEnd == string::npos ) {
-                throw render_error( "control section unterminated: " + sourceCode.substr( controlChangeBegin, 40 ) );
+            size_t end = pos;
+            while( end < length && !isSpace( source[end] ) && source[end] != '(' && source[end] != ')'
+                    && !( source[end] == '%' && end + 1 < length && source[end + 1] == '}' ) ) {
+                end++;
             }
-            string controlChange = trim( sourceCode.substr( controlChangeBegin + 2, controlChangeEnd - controlChangeBegin - 2 ) );
-            vector<string> splitControlChange = split( controlChange, " " );
-            if( splitControlChange[0] == "endfor" || splitControlChange[0] == "endif") {
-                if( splitControlChange.size() != 1 ) {
-                    throw render_error("control section {% " + controlChange + " unrecognized" );
-                }
-                Code *code = new Code();
-                code->startPos = pos;
-                code->endPos = controlChangeBegin;
-                code->templateCode = sourceCode.substr( code->startPos, code->endPos - code->startPos );
-                controlSection->sections.push_back( code );
-                return controlChangeBegin;
-//                if( tokenStack.size() == 0 ) {
-//                    throw render_error("control section {% " + controlChange + " unexpected: no current control stack items" );
-//                }
-//                if( tokenStack[ tokenStack.size() - 1 ] != "for" ) {
-//                    throw render_error("control section {% " + controlChange + " unexpected: current last control stack item is: " + tokenStack[ tokenStack.size() - 1 ] );
-//                }
-//                cout << "token stack old size: " << tokenStack.size() << endl;
-//                tokenStack.erase( tokenStack.end() - 1, tokenStack.end() - 1 );
-//                string varToRemove = varNameStack[ (int)tokenStack.size() - 1 ];
-//                valueByName.erase( varToRemove );
-//                varNameStack.erase( tokenStack.end() - 1, tokenStack.end() - 1 );
-//                cout << "token stack new size: " << tokenStack.size() << endl;
-            } else if( splitControlChange[0] == "for" ) {
-                Code *code = new Code();
-                code->startPos = pos;
-                code->endPos = controlChangeBegin;
-                code->templateCode = sourceCode.substr( code->startPos, code->endPos - code->startPos );
-                controlSection->sections.push_back( code );
-
-                string varname = splitControlChange[1];
-                if( splitControlChange[2] != "in" ) {
-                    throw render_error("control section {% " + controlChange + " unexpected: second word should be 'in'" );
-                }
-                string rangeString = "";
-                for( int i = 3; i < (int)splitControlChange.size(); i++ ) {
-                    rangeString += splitControlChange[i];
-                }
-                rangeString = replaceGlobal( rangeString, " ", "" );
-                vector<string> splitRangeString = split( rangeString, "(" );
-                if( splitRangeString[0] != "range" ) {
-                    throw render_error("control section {% " + controlChange + " unexpected: third word should start with 'range'" );
-                }
-                if( splitRangeString.size() != 2 ) {
-                    throw render_error("control section " + controlChange + " unexpected: should be in format 'range(somevar)' or 'range(somenumber)'" );
-                }
-                string name = split( splitRangeString[1], ")" )[0];
-//                cout << "for range name: " << name << endl;
-                int endValue;
-                if( isNumber( name, &endValue ) ) {
-                } else {
-                    if( valueByName.find( name ) != valueByName.end() ) {
-                        IntValue *intValue = dynamic_cast< IntValue * >( valueByName[ name ] );
-                        if( intValue == 0 ) {
-                            throw render_error("for loop range var " + name + " must be an int (but it's not)");
-                        }
-                        endValue = intValue->value;
-                    } else {
-                        throw render_error("for loop range var " + name + " not recognized");
-                    }                    
-                }
-                int beginValue = 0; // default for now...
-//                cout << "for loop start=" << beginValue << " end=" << endValue << endl;
-                ForSection *forSection = new ForSection();
-                forSection->startPos = controlChangeEnd + 2;
-                forSection->loopStart = beginValue;
-                forSection->loopEnd = endValue;
-                forSection->varName = varname;
-                pos = eatSection( controlChangeEnd + 2, forSection );
-                controlSection->sections.push_back(forSection);
-                size_t controlEndEndPos = sourceCode.find("%}", pos );
-                if( controlEndEndPos == string::npos ) {
-                    throw render_error("No control end section found at: " + sourceCode.substr(pos ) );
-                }
-                string controlEnd = sourceCode.substr( pos, controlEndEndPos - pos + 2 );
-                string controlEndNorm = replaceGlobal( controlEnd, " ", "" );
-                if( controlEndNorm != "{%endfor%}" ) {
-                    throw render_error("No control end section found, expected '{% endfor %}', got '" + controlEnd + "'" );
-                }
-                forSection->endPos = controlEndEndPos + 2;
-                pos = controlEndEndPos + 2;
-//                tokenStack.push_back("for");
-//                varNameStack.push_back(name);
-            } else if (splitControlChange[0] == "if") {
-                Code *code = new Code();
-                code->startPos = pos;
-                code->endPos = controlChangeBegin;
-                code->templateCode = sourceCode.substr(code->startPos, code->endPos - code->startPos);
-                controlSection->sections.push_back(code);
-                const string word = splitControlChange[1];
-                if (JINJA2_TRUE == word)  {
-                    ;
-                } else if (JINJA2_FALSE == word) {
-                    ;
-                }
-                else if (JINJA2_NOT == word) {
-                    ;
-                }
-                else {
-                    ;
-                }
-                IfSection* ifSection = new IfSection(controlChange);
+            token.type = Token::Name;
+            token.length = end - pos;
+        }
+        pos += token.length;
+        return token;
+    }
+    token.start = pos;
+    token.length = 0;
+    if( pos >= length ) {
+        token.type = complete ? Token::End : Token::NeedMore;
+        return token;
+    }
+    size_t tagStart = findTagStart( pos );
+    if( !complete && tagStart == length && source[length - 1] == '{' ) {
+        tagStart = length - 1; // might be the start of a tag, once we know the next char
+    }
+    // and a {{ at the end might be the { of {{%, see findTagStart
+    if( tagStart == pos && !complete && ( pos + 1 >= length || ( source[pos + 1] == '{' && pos + 2 >= length ) ) ) {
+        token.type = Token::NeedMore;
+        return token;
+    }
+    if( tagStart > pos ) {
+        token.type = Token::Text;
+        token.length = tagStart - pos;
+        pos = tagStart;
+        return token;
+    }
+    if( source[pos + 1] == '%' ) {
+        // the words in the block are only lexed once all of it is here
+        if( !complete && source.find( "%}", pos + 2 ) == StringRef::npos ) {
+            token.type = Token::NeedMore;
+            return token;
+        }
+        token.type = Token::BlockBegin;
+        token.length = 2;
+        inBlock = true;
+        blockStart = pos;
+        pos += 2;
+        return token;
+    }
+    size_t nameStart;
+    size_t nameEnd;
+    size_t tagEnd = findVariable( source, pos, &nameStart, &nameEnd );
+    if( tagEnd == StringRef::npos ) {
+        if( !complete ) {
+            token.type = Token::NeedMore;
+            return token;
+        }
+        throw render_error( "substitution unterminated: " + source.substr( pos, 40 ).str() );
+    }
+    token.type = Token::Variable;
+    token.start = nameStart;
+    token.length = nameEnd - nameStart;
+    pos = tagEnd;
+    return token;
+}
 
-                pos = eatSection(controlChangeEnd + 2, ifSection);
-                controlSection->sections.push_back(ifSection);
-                size_t controlEndEndPos = sourceCode.find("%}", pos);
-                if (controlEndEndPos == string::npos) {
-                    throw render_error("No control end of any section found at: " + sourceCode.substr(pos));
-                }
-                string controlEnd = sourceCode.substr(pos, controlEndEndPos - pos + 2);
-                string controlEndNorm = replaceGlobal(controlEnd, " ", "");
-                if (controlEndNorm != "{%endif%}") {
-                    throw render_error("No control end section found, expected '{% endif %}', got '" + controlEnd + "'");
-                }
-                //forSection->endPos = controlEndEndPos + 2;
-                pos = controlEndEndPos + 2;
+// renders the {{}} substitutions in sourceCode.  Anything else, including
+// {% %} tags, is copied through as it is.  Uses the same scanner as the
+// lexer, so braces before a substitution are text here too, eg {{{x}}
+STATIC std::string Template::doSubstitutions( const std::string &sourceCode, const std::map< std::string, Value > &valueByName ) {
+    const StringRef source( sourceCode );
+    SlotTable slots;
+    Code code( source, 0 );
+    size_t pos = 0; // start of the text not yet added to code
+    size_t from = 0; // where to scan for the next tag
+    while( pos < source.length ) {
+        const size_t tagStart = ::findTagStart( source.data, source.length, from );
+        if( tagStart < source.length && source[tagStart + 1] == '%' ) {
+            from = tagStart + 2;
+            continue;
+        }
+        if( tagStart > pos ) {
+            code.addLiteral( pos, tagStart - pos );
+        }
+        if( tagStart == source.length ) {
+            break;
+        }
+        size_t nameStart;
+        size_t nameEnd;
+        pos = findVariable( source, tagStart, &nameStart, &nameEnd );
+        if( pos == StringRef::npos ) {
+            throw render_error( "substitution unterminated: " + source.substr( tagStart, 40 ).str() );
+        }
+        from = pos;
+        code.addVariable( nameStart, nameEnd - nameStart, slots );
+    }
+    code.finish( source.length );
+    vector< const Value * > valueBySlot = slots.bind( valueByName );
+    string result = "";
+    StringSink sink( result );
+    code.render( valueBySlot, sink, RenderOptions() );
+    return result;
+}
+
+Code::Code( const StringRef &sourceCode, size_t startPos ) :
+    source( &sourceCode ),
+    startPos( startPos ),
+    endPos( startPos ) {
+}
+// start is an offset into the template source
+void Code::addLiteral( size_t start, size_t length ) {
+    if( segments.size() > 0 && !segments.back().hasVariable
+            && segments.back().literalStart + segments.back().literalLength == start ) {
+        segments.back().literalLength += length; // eg text split across chunks, see ChunkedTemplateInput
+        return;
+    }
+    CodeSegment segment;
+    segment.literalStart = start;
+    segment.literalLength = length;
+    segment.hasVariable = false;
+    segment.nameStart = 0;
+    segment.nameLength = 0;
+    segment.slot = -1;
+    segments.push_back( segment );
+}
+void Code::addVariable( size_t start, size_t length, SlotTable &slots ) {
+    if( segments.size() == 0 || segments.back().hasVariable ) {
+        addLiteral( start, 0 );
+    }
+    CodeSegment &segment = segments.back();
+    segment.hasVariable = true;
+    segment.nameStart = start;
+    segment.nameLength = length;
+    segment.slot = slots.intern( std::string( source->data + start, length ) );
+}
+void Code::finish( size_t endPos ) {
+    this->endPos = endPos;
+}
 
-            } else {
-                throw render_error("control section {% " + controlChange + " unexpected" );
+void Code::render( std::vector< const Value * > &valueBySlot, OutputSink &out, const RenderOptions &options ) const {
+    for( size_t i = 0; i < segments.size(); i++ ) {
+        const CodeSegment &segment = segments[i];
+        if( segment.literalLength > 0 ) {
+            out.write( source->data + segment.literalStart, segment.literalLength );
+        }
+        if( segment.hasVariable ) {
+            const Value *value = valueBySlot[segment.slot];
+            if( value == 0 ) {
+                throw render_error( "name " + std::string( source->data + segment.nameStart, segment.nameLength ) + " not defined" );
             }
+            value->render( out );
         }
     }
+}
 
-//    vector<string> controlSplit = split( sourceCode, "{%" );
-////    int startI = 1;
-////    if( controlSplit.substr(0,2) == "{%" ) {
-////        startI = 0;
-////    }
-//    string updatedString = "";
-//    for( int i = 0; i < (int)controlSplit.size(); i++ ) {
-//        if( controlSplit[i].substr(0,2) == "{%" ) {
-//            vector<string> splitControlPair = split(controlSplit[i], "%}" );
-//            string controlString = splitControlPair[0];
-//        } else {
-//            updatedString += doSubstitutions( controlSplit[i], valueByName );
-//        }
-//    }
-////    string templatedString = doSubstitutions( sourceCode, valueByName );
-//    return updatedString;
-}
-STATIC std::string Template::doSubstitutions( std::string sourceCode, std::map< std::string, Value *> valueByName ) {
-    int startI = 1;
-    if( sourceCode.substr(0,2) == "{{" ) {
-        startI = 0;
-    }
-    string templatedString = "";
-    vector<string> splitSource = split( sourceCode, "{{" );
-    if( startI == 1 ) {
-        templatedString = splitSource[0];
-    }
-    for( size_t i = startI; i < splitSource.size(); i++ ) {
-        if (splitSource[i].size() <= 0)
-            continue;
-        vector<string> thisSplit = split( splitSource[i], "}}" );
-        string name = trim( split( thisSplit[0], "|" )[0] );
-//        cout << "name: " << name << endl;
-        if( valueByName.find( name ) == valueByName.end() ) {
-            throw render_error( "name " + name + " not defined" );
+// whether a loop with this many iterations is rendered on pool.  A pool
+// without threads would only add the cost of the chunk buffers
+bool RenderOptions::splitsLoop( long long iterations ) const {
+    return pool != 0 && pool->size() > 0 && iterations > 1 && iterations >= parallelLoopMinIterations;
+}
+// splits the loop into a few chunks per thread, so that threads which finish
+// early can pick up more, and renders each chunk into its own buffer, with its
+// own copy of valueBySlot, to hold its own loop variable.  The output, and any
+// error, is the same as rendering serially: chunks are written in order, up to
+// and including the first that fails
+void ForSection::renderParallel( std::vector< const Value * > &valueBySlot, OutputSink &out, const RenderOptions &options, int end ) const {
+    const long long iterations = (long long)end - loopStart;
+    const long long maxChunks = 4 * ( options.pool->size() + 1 );
+    const size_t numChunks = (size_t)( iterations < maxChunks ? iterations : maxChunks );
+    vector< string > outputs( numChunks );
+    vector< exception_ptr > errors( numChunks );
+    const RenderOptions serial;
+    options.pool->parallelFor( numChunks, [&]( size_t chunk ) {
+        const int chunkStart = (int)( loopStart + iterations * chunk / numChunks );
+        const int chunkEnd = (int)( loopStart + iterations * ( chunk + 1 ) / numChunks );
+        vector< const Value * > chunkValueBySlot( valueBySlot );
+        Value loopValue( chunkStart );
+        chunkValueBySlot[varSlot] = &loopValue;
+        StringSink sink( outputs[chunk] );
+        try {
+            for( int i = chunkStart; i < chunkEnd; i++ ) {
+                loopValue.setInt( i );
+                for( size_t j = 0; j < sections.size(); j++ ) {
+                    sections[j]->render( chunkValueBySlot, sink, serial );
+                }
+            }
+        } catch( ... ) {
+            errors[chunk] = current_exception();
         }
-        Value *value = valueByName[ name ];
-        templatedString += value->render();
-        if( thisSplit.size() > 0 ) {
-            templatedString += thisSplit[1];
+    } );
+    for( size_t chunk = 0; chunk < numChunks; chunk++ ) {
+        out.write( outputs[chunk] );
+        if( errors[chunk] ) {
+            rethrow_exception( errors[chunk] );
         }
     }
-    return templatedString;
 }
 
-void IfSection::parseIfCondition(const std::string& expression) {
-    const std::vector<std::string> splittedExpression = split(expression, " ");
-    if (splittedExpression.empty() || splittedExpression[0] != "if") {
+void IfSection::parseIfCondition(StringRef source, const std::vector<Token>& words, SlotTable &slots) {
+    if (words.empty() || source.substr(words[0].start, words[0].length) != "if") {
         throw render_error("if statement expected.");
     }
 
     std::size_t expressionIndex = 1;
-    if (splittedExpression.size() < expressionIndex + 1) {
+    if (words.size() < expressionIndex + 1) {
         throw render_error("Any expression expected after if statement.");
     }
-    m_isNegation = (JINJA2_NOT == splittedExpression[expressionIndex]);
+    m_isNegation = (source.substr(words[expressionIndex].start, words[expressionIndex].length) == JINJA2_NOT);
     expressionIndex += (m_isNegation) ? 1 : 0;
-    if (splittedExpression.size() < expressionIndex + 1) {
+    if (words.size() < expressionIndex + 1) {
         if (!m_isNegation)
             throw render_error("Any expression expected after if statement.");
         else
             throw render_error("Any expression expected after if not statement.");
     }
-    m_variableName = splittedExpression[expressionIndex];
-    if (splittedExpression.size() > expressionIndex + 1) {
-        throw render_error(std::string("Unexpected expression after variable name: ") + splittedExpression[expressionIndex + 1]);
+    m_variableName = source.substr(words[expressionIndex].start, words[expressionIndex].length).str();
+    if (words.size() > expressionIndex + 1) {
+        throw render_error(std::string("Unexpected expression after variable name: ") + source.substr(words[expressionIndex + 1].start, words[expressionIndex + 1].length).str());
+    }
+    if (JINJA2_TRUE == m_variableName || JINJA2_FALSE == m_variableName) {
+        m_slot = -1;
+        m_literalValue = JINJA2_TRUE == m_variableName;
+    } else {
+        m_slot = slots.intern(m_variableName);
+        m_literalValue = false;
     }
 }
 
-bool IfSection::computeExpression(const std::map< std::string, Value *> &valueByName) const {
-    if (JINJA2_TRUE == m_variableName) {
-        return true ^ m_isNegation;
-    }
-    else if (JINJA2_FALSE == m_variableName) {
-        return false ^ m_isNegation;
+bool IfSection::computeExpression(const std::vector< const Value * > &valueBySlot) const {
+    if (m_slot < 0) {
+        return m_literalValue ^ m_isNegation;
     }
     else {
-        const bool valueExists = valueByName.count(m_variableName) > 0;
-        if (!valueExists) {
+        const Value *value = valueBySlot[m_slot];
+        if (value == 0) {
             return false ^ m_isNegation;
         }
-        return valueByName.at(m_variableName)->isTrue() ^ m_isNegation;
+        return value->isTrue() ^ m_isNegation;
     }
 }
 
@@ -12,14 +12,18 @@
 // - variable substitution, ie {{myvar}}
 // - for loops, ie {% for i in range(myvar) %}
 
+#pragma once
+
 #include <string>
 #include <iostream>
 #include <map>
 #include <vector>
 #include <stdexcept>
 #include <sstream>
+#include <memory>
 
 #include "stringhelper.h"
+#include "numberformat.h"
 
 #define VIRTUAL virtual
 #define STATIC static
@@ -33,62 +37,484 @@ public:
     }
 };
 
-class Value {
+// where rendered output goes: rendering writes each piece of output to the
+// sink as soon as it is produced, rather than building up strings for each
+// section, and concatenating them
+class OutputSink {
 public:
-    virtual ~Value() {}
-    virtual std::string render() = 0;
-    virtual bool isTrue() const = 0;
+    virtual ~OutputSink() {}
+    virtual void write( const char *data, size_t length ) = 0;
+    void write( const std::string &data ) {
+        write( data.data(), data.length() );
+    }
 };
-class IntValue : public Value {
+// appends to a std::string
+class StringSink : public OutputSink {
 public:
-    int value;
-    IntValue( int value ) :
-        value( value ) {
+    std::string &target;
+    StringSink( std::string &target ) :
+        target( target ) {
     }
-    virtual std::string render() {
-        return toString( value );
-    }
-    bool isTrue() const {
-        return value != 0;
+    virtual void write( const char *data, size_t length ) {
+        target.append( data, length );
     }
 };
-class FloatValue : public Value {
+class StreamSink : public OutputSink {
 public:
-    float value;
-    FloatValue( float value ) :
-        value( value ) {
+    std::ostream &target;
+    StreamSink( std::ostream &target ) :
+        target( target ) {
     }
-    virtual std::string render() {
-        return toString( value );
+    virtual void write( const char *data, size_t length ) {
+        target.write( data, length );
     }
-    bool isTrue() const {
-        return value != 0.0;
+};
+// calls callback( userData, data, length ) for each piece of output
+class CallbackSink : public OutputSink {
+public:
+    typedef void (*Callback)( void *userData, const char *data, size_t length );
+    Callback callback;
+    void *userData;
+    CallbackSink( Callback callback, void *userData ) :
+        callback( callback ),
+        userData( userData ) {
+    }
+    virtual void write( const char *data, size_t length ) {
+        callback( userData, data, length );
     }
 };
-class StringValue : public Value {
+
+// the value of a template variable: an int, a float or a string.  Ints,
+// floats and strings of up to InlineCapacity chars are stored inside the
+// Value itself, so setting a value doesnt need a heap allocation, and
+// rendering switches on the type, rather than calling a virtual method
+class Value {
 public:
-    std::string value;
-    StringValue( std::string value ) :
-        value( value ) {
+    enum Type {
+        Undefined,
+        Int,
+        Float,
+        String
+    };
+    static const size_t InlineCapacity = 16;
+
+    Value();
+    Value( int value );
+    Value( float value );
+    Value( float value, int precision );
+    Value( const std::string &value );
+    Value( const char *data, size_t length );
+    Value( const Value &other );
+    Value &operator=( const Value &other );
+    ~Value();
+
+    void setInt( int value );
+    void setFloat( float value, int precision = -1 );
+    void setString( const char *data, size_t length );
+
+    Type getType() const {
+        return type;
+    }
+    int getInt() const {
+        return intValue;
     }
-    virtual std::string render() {
-        return value;
+    float getFloat() const {
+        return floatValue;
+    }
+    // number of decimal places floats are rendered with, or -1 to render
+    // the shortest string that reads back as the same float
+    int getFloatPrecision() const {
+        return floatPrecision;
+    }
+    const char *getStringData() const {
+        return length <= InlineCapacity ? inlineString : heapString;
+    }
+    size_t getStringLength() const {
+        return length;
     }
     bool isTrue() const {
-        return !value.empty();
+        switch( type ) {
+            case Int:
+                return intValue != 0;
+            case Float:
+                return floatValue != 0.0;
+            case String:
+                return length != 0;
+            default:
+                return false;
+        }
     }
+    void render( OutputSink &out ) const {
+        switch( type ) {
+            case Int: {
+                char buffer[FORMAT_INT_MAX_CHARS];
+                out.write( buffer, formatInt( intValue, buffer ) );
+                break;
+            }
+            case Float: {
+                char buffer[FORMAT_FLOAT_FIXED_MAX_CHARS];
+                if( floatPrecision < 0 ) {
+                    out.write( buffer, formatFloat( floatValue, buffer ) );
+                } else {
+                    out.write( buffer, formatFloatFixed( floatValue, floatPrecision, buffer ) );
+                }
+                break;
+            }
+            case String:
+                out.write( getStringData(), length );
+                break;
+            default:
+                break;
+        }
+    }
+    std::string render() const {
+        std::string result;
+        StringSink sink( result );
+        render( sink );
+        return result;
+    }
+
+private:
+    void clear();
+
+    Type type;
+    int floatPrecision;
+    size_t length; // of the string, if type is String
+    union {
+        int intValue;
+        float floatValue;
+        char inlineString[InlineCapacity];
+        char *heapString;
+    };
 };
 
 class Root;
 class ControlSection;
+class ThreadPool;
+class TemplateCache;
+
+// how to render, as opposed to what with.  By default everything renders on
+// the calling thread
+class RenderOptions {
+public:
+    // if not null, for loops with at least parallelLoopMinIterations
+    // iterations are split into chunks, which are rendered on pool, each into
+    // its own buffer, and then written out in order.  Only the outermost such
+    // loop is split; loops inside a chunk render serially
+    ThreadPool *pool;
+    int parallelLoopMinIterations;
+
+    RenderOptions() :
+        pool( 0 ),
+        parallelLoopMinIterations( 10000 ) {
+    }
+    bool splitsLoop( long long iterations ) const;
+};
+
+// the text of a template.  Compiled templates point into it, rather than
+// copying it, and share ownership of it.  It can be a string, or a file
+// mapped read-only into memory, which avoids reading large templates into
+// the heap at all
+class TemplateSource {
+public:
+    const char *data;
+    size_t length;
+
+    virtual ~TemplateSource() {}
+    StringRef text() const {
+        return StringRef( data, length );
+    }
+    static std::shared_ptr< const TemplateSource > fromString( std::string sourceCode );
+    // throws std::runtime_error if the file cant be opened or mapped
+    static std::shared_ptr< const TemplateSource > mapFile( const std::string &path );
+    // doesnt copy or own data, which must outlive every template using it,
+    // eg a static array, as generated by jinja2cpplight_precompile
+    static std::shared_ptr< const TemplateSource > fromStatic( const char *data, size_t length );
+    // length bytes of owner, from offset, keeping owner alive
+    static std::shared_ptr< const TemplateSource > slice( std::shared_ptr< const TemplateSource > owner, size_t offset, size_t length );
+protected:
+    TemplateSource() : data( "" ), length( 0 ) {}
+private:
+    TemplateSource( const TemplateSource & ) = delete;
+    TemplateSource &operator=( const TemplateSource & ) = delete;
+};
+
+// a piece of template source, as found by TemplateLexer.  start and length
+// locate the token in the source
+class Token {
+public:
+    enum Type {
+        Text, // literal text, outside of any tag
+        Variable, // the variable name in a {{ }} tag, trimmed, and without any | filter
+        BlockBegin, // {%
+        Name, // a word inside {% %}
+        LeftParen,
+        RightParen,
+        BlockEnd, // %}
+        End, // end of the source
+        NeedMore // the source is incomplete, and the next token isnt all there yet
+    };
+    Type type;
+    size_t start;
+    size_t length;
+};
+
+// splits template source into Tokens, in a single pass over the source,
+// without allocating.  If complete is false, more source may be appended
+// later: the lexer then returns NeedMore rather than a token that might
+// continue past the end of what it has so far, eg a tag split across two
+// chunks.  pos is left at the start of that token, so once source has been
+// extended, next() picks up from there
+class TemplateLexer {
+public:
+    StringRef source;
+    bool complete;
+    size_t pos;
+    bool inBlock;
+    size_t blockStart;
+
+    // [[[cog
+    // import cog_addheaders
+    // cog_addheaders.add(classname='TemplateLexer')
+    // ]]]
+    // generated, using cog:
+    TemplateLexer( StringRef source, bool complete );
+    size_t findTagStart( size_t from );
+    Token next();
+
+    // [[[end]]]
+
+    TemplateLexer( StringRef source ) :
+        TemplateLexer( source, true ) {
+    }
+};
+
+// variable names are interned into slots when a template is compiled; at
+// render time the values are passed as a vector indexed by slot, so looking up
+// a variable is just indexing into that vector.  A null entry means the
+// variable isn't set
+class SlotTable {
+public:
+    std::vector< std::string > names;
+    std::map< std::string, int > slotByName;
+
+    // [[[cog
+    // import cog_addheaders
+    // cog_addheaders.add(classname='SlotTable')
+    // ]]]
+    // generated, using cog:
+    int intern( const std::string &name );
+    int find( const std::string &name ) const;
+    int size() const;
+    std::vector< const Value * > bind( const std::map< std::string, Value > &valueByName ) const;
+
+    // [[[end]]]
+};
+
+// template source, read a chunk at a time from a callback, for
+// CompiledTemplate to parse as it arrives.  text holds everything read so far
+class ChunkedTemplateInput {
+public:
+    typedef size_t (*ReadCallback)( void *userData, char *buffer, size_t size ); // returns 0 at the end
+    ReadCallback read;
+    void *userData;
+    size_t chunkSize;
+    std::string text;
+
+    // [[[cog
+    // import cog_addheaders
+    // cog_addheaders.add(classname='ChunkedTemplateInput')
+    // ]]]
+    // generated, using cog:
+    ChunkedTemplateInput( ReadCallback read, void *userData, size_t chunkSize );
+    bool readMore();
+
+    // [[[end]]]
+};
+
+// the parsed form of a template: parse runs once, in the constructor,
+// and render() only walks the resulting tree, so it can be called as many
+// times as needed, with different values each time.  Rendering doesnt modify
+// it, so it can be shared, and rendered from several threads at once, each
+// with its own values, eg in a Context
+class CompiledTemplate {
+public:
+    std::shared_ptr< const TemplateSource > source;
+    StringRef sourceCode; // the text of source
+    Root *root;
+    SlotTable slots;
+
+    // [[[cog
+    // import cog_addheaders
+    // cog_addheaders.add(classname='CompiledTemplate', cppfile='compiledtemplate.cpp')
+    // ]]]
+    // generated, using cog:
+    CompiledTemplate( std::string sourceCode );
+    CompiledTemplate( std::shared_ptr< const TemplateSource > source );
+    CompiledTemplate( std::istream &in, size_t chunkSize );
+    CompiledTemplate( ChunkedTemplateInput::ReadCallback read, void *userData, size_t chunkSize );
+    VIRTUAL ~CompiledTemplate();
+    std::string render( const std::map< std::string, Value > &valueByName ) const;
+    std::string render( std::vector< const Value * > &valueBySlot ) const;
+    void render( std::vector< const Value * > &valueBySlot, OutputSink &out, const RenderOptions &options ) const;
+    void renderInto( std::vector< const Value * > &valueBySlot, std::string &buffer, const RenderOptions &options ) const;
+    void print() const;
+    std::string serialize() const;
+    STATIC std::shared_ptr< const CompiledTemplate > load( std::shared_ptr< const TemplateSource > blob );
+
+    // [[[end]]]
+
+    static const size_t defaultChunkSize = 64 * 1024;
+    // sections are rendered, serialized and destroyed recursively, one call
+    // per level, so templates nesting {% for %} and {% if %} deeper than this
+    // are rejected with a render_error, when parsed, or loaded, rather than
+    // overflowing the stack later
+    static const size_t maxNestingDepth = 1000;
+    CompiledTemplate( std::istream &in ) :
+        CompiledTemplate( in, defaultChunkSize ) {
+    }
+    CompiledTemplate( ChunkedTemplateInput::ReadCallback read, void *userData ) :
+        CompiledTemplate( read, userData, defaultChunkSize ) {
+    }
+    void render( std::vector< const Value * > &valueBySlot, OutputSink &out ) const {
+        render( valueBySlot, out, RenderOptions() );
+    }
+    void renderInto( std::vector< const Value * > &valueBySlot, std::string &buffer ) const {
+        renderInto( valueBySlot, buffer, RenderOptions() );
+    }
+private:
+    CompiledTemplate() : root( 0 ) {} // for load
+    // the tree points into sourceCode, so it cant be copied
+    CompiledTemplate( const CompiledTemplate & ) = delete;
+    CompiledTemplate &operator=( const CompiledTemplate & ) = delete;
+};
+
+// many compiled templates, serialized into one blob, with a hash table
+// index, so any of them can be found by name without searching, eg:
+//
+//     TemplateBundleWriter writer;
+//     writer.add( "conv", CompiledTemplate( convSource ) );
+//     ...
+//     out << writer.serialize();
+//
+//     TemplateBundle bundle( TemplateSource::mapFile( "kernels.j2cb" ) );
+//     std::shared_ptr< const CompiledTemplate > conv = bundle.load( "conv" );
+class TemplateBundleWriter {
+public:
+    std::vector< std::string > names;
+    std::vector< std::string > blobs; // serialized templates, same order as names
+
+    // [[[cog
+    // import cog_addheaders
+    // cog_addheaders.add(classname='TemplateBundleWriter', cppfile='compiledtemplate.cpp')
+    // ]]]
+    // generated, using cog:
+    void add( const std::string &name, const CompiledTemplate &compiled );
+    std::string serialize() const;
+
+    // [[[end]]]
+};
+
+class TemplateBundle {
+public:
+    std::shared_ptr< const TemplateSource > blob;
+    size_t numEntries;
+    size_t numBuckets; // a power of two
+    size_t bucketsOffset; // offsets in blob
+    size_t entriesOffset;
+
+    // [[[cog
+    // import cog_addheaders
+    // cog_addheaders.add(classname='TemplateBundle', cppfile='compiledtemplate.cpp')
+    // ]]]
+    // generated, using cog:
+    TemplateBundle( std::shared_ptr< const TemplateSource > blob );
+    size_t size() const;
+    std::string name( size_t index ) const;
+    bool contains( const std::string &name ) const;
+    std::shared_ptr< const CompiledTemplate > load( const std::string &name ) const;
+    long long findEntry( const std::string &name ) const;
+    StringRef entryName( size_t index ) const;
+    StringRef entryTemplate( size_t index ) const;
+
+    // [[[end]]]
+};
+
+// the values of the variables for rendering one CompiledTemplate, and
+// whatever else changes from one render to the next.  The compiled template
+// isnt modified, so it can be shared between any number of contexts, eg one
+// per thread; each context should only be used by one thread at a time
+class Context {
+public:
+    const CompiledTemplate *compiled; // not owned, and must outlive this
+    std::map< std::string, Value > valueByName;
+    std::vector< const Value * > valueBySlot; // the values in valueByName, indexed by compiled->slots
+    size_t outputSizeHint; // largest output rendered so far, used to size output buffers
+    RenderOptions options;
+
+    // [[[cog
+    // import cog_addheaders
+    // cog_addheaders.add(classname='Context')
+    // ]]]
+    // generated, using cog:
+    Context( const CompiledTemplate &compiled );
+    Context( const Context &other );
+    Context &operator=( const Context &other );
+    Context &setValue( std::string name, int value );
+    Context &setValue( std::string name, float value );
+    Context &setValue( std::string name, float value, int precision );
+    Context &setValue( std::string name, std::string value );
+    Context &storeValue( std::string name, const Value &value );
+    Context &setParallelLoops( ThreadPool *pool, int minIterations );
+    void bind();
+    std::string render();
+    void render( OutputSink &out );
+    void render( std::ostream &out );
+    void renderInto( std::string &buffer );
+
+    // [[[end]]]
+};
+
+// renders many contexts at once, eg one kernel template with hundreds of
+// different sets of values, spread over its own pool of threads.  Each thread
+// renders into its own scratch buffer, which is kept between calls, so each
+// output is allocated once, at its final size, or not at all when outputs is
+// reused.  One batch at a time: render shouldnt be called from two threads at
+// once
+class BatchRenderer {
+public:
+    ThreadPool *pool; // owned
+    std::vector< std::string > scratch; // one per thread in pool, plus one for the calling thread
+
+    // [[[cog
+    // import cog_addheaders
+    // cog_addheaders.add(classname='BatchRenderer')
+    // ]]]
+    // generated, using cog:
+    BatchRenderer();
+    BatchRenderer( int numThreads );
+    ~BatchRenderer();
+    std::vector< std::string > render( std::vector< Context > &contexts );
+    void render( std::vector< Context > &contexts, std::vector< std::string > &outputs );
+
+    // [[[end]]]
 
+private:
+    BatchRenderer( const BatchRenderer & ) = delete;
+    BatchRenderer &operator=( const BatchRenderer & ) = delete;
+};
+
+// a template, with its values: compiles itself the first time it is
+// rendered, into compiled, and keeps the values in context
 class Template {
 public:
-    std::string sourceCode;
+    std::shared_ptr< const TemplateSource > source;
 
-    std::map< std::string, Value * > valueByName;
+    std::map< std::string, Value > valueByName; // values set before compiling, after which they are in context
 //    std::vector< std::string > varNameStack;
-    Root *root;
+    TemplateCache *cache; // if not null, compiled is looked up in, or added to, this
+    std::shared_ptr< const CompiledTemplate > compiled; // created by the first call to compile() or render()
+    Context *context; // created along with compiled
 
     // [[[cog
     // import cog_addheaders
@@ -96,15 +522,22 @@ public:
     // ]]]
     // generated, using cog:
     Template( std::string sourceCode );
+    Template( std::shared_ptr< const TemplateSource > source );
+    Template( std::string sourceCode, TemplateCache &cache );
     STATIC bool isNumber( std::string astring, int *p_value );
     VIRTUAL ~Template();
     Template &setValue( std::string name, int value );
     Template &setValue( std::string name, float value );
+    Template &setValue( std::string name, float value, int precision );
     Template &setValue( std::string name, std::string value );
+    Template &storeValue( std::string name, const Value &value );
+    const CompiledTemplate *compile();
     std::string render();
+    void render( OutputSink &out );
+    void render( std::ostream &out );
+    void renderInto( std::string &buffer );
     void print(ControlSection *section);
-    int eatSection( int pos, ControlSection *controlSection );
-    STATIC std::string doSubstitutions( std::string sourceCode, std::map< std::string, Value *> valueByName );
+    STATIC std::string doSubstitutions( const std::string &sourceCode, const std::map< std::string, Value > &valueByName );
 
     // [[[end]]]
 };
@@ -112,7 +545,12 @@ public:
 class ControlSection {
 public:
     std::vector< ControlSection * >sections;
-    virtual std::string render( std::map< std::string, Value *> &valueByName ) = 0;
+    virtual ~ControlSection() {
+        for( size_t i = 0; i < sections.size(); i++ ) {
+            delete sections[i];
+        }
+    }
+    virtual void render( std::vector< const Value * > &valueBySlot, OutputSink &out, const RenderOptions &options ) const = 0;
     virtual void print() {
         print("");
     }
@@ -122,13 +560,13 @@ public:
 class Container : public ControlSection {
 public:
 //    std::vector< ControlSection * >sections;
-    int sourceCodePosStart;
-    int sourceCodePosEnd;
+    size_t sourceCodePosStart;
+    size_t sourceCodePosEnd;
 
-//    std::string render( std::map< std::string, Value *> valueByName );
+//    std::string render( std::map< std::string, Value > valueByName );
     virtual void print( std::string prefix ) {
         std::cout << prefix << "Container ( " << sourceCodePosStart << ", " << sourceCodePosEnd << " ) {" << std::endl;
-        for( int i = 0; i < (int)sections.size(); i++ ) {
+        for( size_t i = 0; i < sections.size(); i++ ) {
             sections[i]->print( prefix + "    " );
         }
         std::cout << prefix << "}" << std::endl;
@@ -139,73 +577,110 @@ class ForSection : public ControlSection {
 public:
     int loopStart;
     int loopEnd;
+    std::string loopEndName; // if not empty, loopEnd is read from this variable at render time
+    int loopEndSlot; // of loopEndName, or -1 if loopEnd is a number
     std::string varName;
-    int startPos;
-    int endPos;
-    std::string render( std::map< std::string, Value *> &valueByName ) {
-        std::string result = "";
+    int varSlot;
+    size_t startPos;
+    size_t endPos;
+    int resolveLoopEnd( std::vector< const Value * > &valueBySlot ) const {
+        if( loopEndSlot < 0 ) {
+            return loopEnd;
+        }
+        const Value *value = valueBySlot[loopEndSlot];
+        if( value == 0 ) {
+            throw render_error("for loop range var " + loopEndName + " not recognized");
+        }
+        if( value->getType() != Value::Int ) {
+            throw render_error("for loop range var " + loopEndName + " must be an int (but it's not)");
+        }
+        return value->getInt();
+    }
+    void render( std::vector< const Value * > &valueBySlot, OutputSink &out, const RenderOptions &options ) const {
 //        bool nameExistsBefore = false;
-        if( valueByName.find( varName ) != valueByName.end() ) {
+        if( valueBySlot[varSlot] != 0 ) {
             throw render_error("variable " + varName + " already exists in this context" );
         }
-        for( int i = loopStart; i < loopEnd; i++ ) {
-            valueByName[varName] = new IntValue( i );
-            for( size_t j = 0; j < sections.size(); j++ ) {
-                result += sections[j]->render( valueByName );
+        const int end = resolveLoopEnd( valueBySlot );
+        if( options.splitsLoop( (long long)end - loopStart ) ) {
+            renderParallel( valueBySlot, out, options, end );
+            return;
+        }
+        // the loop variable lives here, for the whole loop, and is updated in
+        // place on each iteration
+        Value loopValue( loopStart );
+        valueBySlot[varSlot] = &loopValue;
+        try {
+            for( int i = loopStart; i < end; i++ ) {
+                loopValue.setInt( i );
+                for( size_t j = 0; j < sections.size(); j++ ) {
+                    sections[j]->render( valueBySlot, out, options );
+                }
             }
-            delete valueByName[varName];
-            valueByName.erase( varName );
+        } catch( ... ) {
+            valueBySlot[varSlot] = 0;
+            throw;
         }
-        return result;
+        valueBySlot[varSlot] = 0;
     }
+    void renderParallel( std::vector< const Value * > &valueBySlot, OutputSink &out, const RenderOptions &options, int end ) const;
     //Container *contents;
     virtual void print( std::string prefix ) {
-        std::cout << prefix << "For ( " << varName << " in range(" << loopStart << ", " << loopEnd << " ) {" << std::endl;
-        for( int i = 0; i < (int)sections.size(); i++ ) {
+        std::cout << prefix << "For ( " << varName << " in range(" << loopStart << ", " << ( loopEndName == "" ? toString( loopEnd ) : loopEndName ) << " ) {" << std::endl;
+        for( size_t i = 0; i < sections.size(); i++ ) {
             sections[i]->print( prefix + "    " );
         }
         std::cout << prefix << "}" << std::endl;
     }
 };
 
+// a piece of a Code section: some literal text, optionally followed by the
+// value of a {{variable}}.  Both are offsets into the template source, so
+// compiling doesnt copy any of the template text
+class CodeSegment {
+public:
+    size_t literalStart;
+    size_t literalLength;
+    bool hasVariable;
+    size_t nameStart; // the variable name, for error messages
+    size_t nameLength;
+    int slot;
+};
+
 class Code : public ControlSection {
 public:
 //    vector< ControlSection * >sections;
-    int startPos;
-    int endPos;
-    std::string templateCode;
+    const StringRef *source; // sourceCode of the CompiledTemplate that owns this
+    size_t startPos;
+    size_t endPos;
+    std::vector< CodeSegment > segments; // source from startPos to endPos, split up at compile time
 
-    std::string render();
+    Code( const StringRef &sourceCode, size_t startPos );
+    void addLiteral( size_t start, size_t length );
+    void addVariable( size_t start, size_t length, SlotTable &slots );
+    void finish( size_t endPos );
     virtual void print( std::string prefix ) {
         std::cout << prefix << "Code ( " << startPos << ", " << endPos << " ) {" << std::endl;
-        for( int i = 0; i < (int)sections.size(); i++ ) {
+        for( size_t i = 0; i < sections.size(); i++ ) {
             sections[i]->print( prefix + "    " );
         }
         std::cout << prefix << "}" << std::endl;
     }
-    virtual std::string render( std::map< std::string, Value *> &valueByName ) {
-//        std::string templateString = sourceCode.substr( startPos, endPos - startPos );
-//        std::cout << "Code section, rendering [" << templateCode << "]" << std::endl;
-        std::string processed = Template::doSubstitutions( templateCode, valueByName );
-//        std::cout << "Code section, after rendering: [" << processed << "]" << std::endl;
-        return processed;
-    }
+    virtual void render( std::vector< const Value * > &valueBySlot, OutputSink &out, const RenderOptions &options ) const;
 };
 
 class Root : public ControlSection {
 public:
     virtual ~Root() {}
 //    std::vector< ControlSection * >sections;
-    virtual std::string render( std::map< std::string, Value *> &valueByName ) {
-        std::string resultString = "";
-        for( int i = 0; i < (int)sections.size(); i++ ) {
-            resultString += sections[i]->render( valueByName );
+    virtual void render( std::vector< const Value * > &valueBySlot, OutputSink &out, const RenderOptions &options ) const {
+        for( size_t i = 0; i < sections.size(); i++ ) {
+            sections[i]->render( valueBySlot, out, options );
         }     
-        return resultString;   
     }
     virtual void print(std::string prefix) {
         std::cout << prefix << "Root {" << std::endl;
-        for( int i = 0; i < (int)sections.size(); i++ ) {
+        for( size_t i = 0; i < sections.size(); i++ ) {
             sections[i]->print( prefix + "    " );
         }
         std::cout << prefix << "}" << std::endl;
@@ -214,20 +689,28 @@ public:
 
 class IfSection : public ControlSection {
 public:
-    IfSection(const std::string& expression) {
-        parseIfCondition(expression);
+    IfSection(StringRef source, const std::vector<Token>& words, SlotTable &slots) {
+        parseIfCondition(source, words, slots);
     }
+    //? For loading a serialized template, see CompiledTemplate::load.
+    IfSection(bool isNegation, const std::string& variableName, int slot) :
+        m_isNegation(isNegation),
+        m_variableName(variableName),
+        m_slot(slot),
+        m_literalValue(slot < 0 && variableName == "True") {
+    }
+
+    bool isNegation() const { return m_isNegation; }
+    const std::string& variableName() const { return m_variableName; }
+    int slot() const { return m_slot; }
 
-    std::string render(std::map< std::string, Value *> &valueByName) {
-        std::stringstream ss;
-        const bool expressionValue = computeExpression(valueByName);
+    void render(std::vector< const Value * > &valueBySlot, OutputSink &out, const RenderOptions &options) const {
+        const bool expressionValue = computeExpression(valueBySlot);
         if (expressionValue) {
             for (size_t j = 0; j < sections.size(); j++) {
-                ss << sections[j]->render(valueByName);
+                sections[j]->render(valueBySlot, out, options);
             }
         }
-        const std::string renderResult = ss.str();
-        return renderResult;
     }
 
     void print(std::string prefix) {
@@ -235,7 +718,7 @@ public:
             << ((m_isNegation) ? "not " : "") 
             << m_variableName << " ) {" << std::endl;
         if (true) {
-            for (int i = 0; i < (int)sections.size(); i++) {
+            for (size_t i = 0; i < sections.size(); i++) {
                 sections[i]->print(prefix + "    ");
             }
         }
@@ -243,15 +726,19 @@ public:
     }
 
 private:
-    //? It determines m_isNegation and m_variableName from @param[in] expression.
-    //? @param[in] expression E.g. "if not myVariable" where myVariable is set by myTemplate.setValue( "myVariable", <any_value> );
-    //?                       The result of this statement is false if myVariable is initialized.
-    void parseIfCondition(const std::string& expression);
+    //? It determines m_isNegation, m_variableName and m_slot from @param[in] words.
+    //? @param[in] source Template source, that the words point into.
+    //? @param[in] words Tokens of the statement, e.g. of "if not myVariable" where myVariable is set by myTemplate.setValue( "myVariable", <any_value> );
+    //?                  The result of this statement is false if myVariable is initialized.
+    //? @param[in] slots Table to intern myVariable into.
+    void parseIfCondition(StringRef source, const std::vector<Token>& words, SlotTable &slots);
 
-    bool computeExpression(const std::map< std::string, Value *> &valueByName) const;
+    bool computeExpression(const std::vector< const Value * > &valueBySlot) const;
 
     bool m_isNegation; ///< Tells whether is there "if not" or just "if" at the begin of expression.
     std::string m_variableName; ///< This simple "if" implementation allows single variable condition only.
+    int m_slot; ///< Slot of m_variableName, or -1 for True and False.
+    bool m_literalValue; ///< Value of True or False, when m_slot is -1, so rendering needn't compare names.
 };
 
 }
@@ -0,0 +1,756 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, 
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// CompiledTemplate, and its serialized forms: parsing, rendering, and the
+// blob and bundle formats.  Kept apart from Jinja2CppLight.cpp so that
+// cog_addheaders, which matches definitions by class name prefix, doesnt
+// mistake CompiledTemplate's for Template's
+
+#include <iostream>
+#include <string>
+#include <map>
+#include <vector>
+#include <utility>
+#include <cstring>
+#include <climits>
+#include <stdint.h>
+
+#include "stringhelper.h"
+
+#include "Jinja2CppLight.h"
+
+using namespace std;
+
+namespace
+{
+    const std::string JINJA2_TRUE = "True";
+    const std::string JINJA2_FALSE = "False";
+}
+
+namespace Jinja2CppLight {
+
+#undef VIRTUAL
+#define VIRTUAL
+#undef STATIC
+#define STATIC
+
+namespace {
+    // ints, as in range(3); optionally signed.  Anything out of the range of
+    // an int isnt one, so, like any other word, is taken as a variable name
+    bool parseInt( StringRef source, size_t start, size_t length, int *p_value ) {
+        size_t pos = start;
+        size_t end = start + length;
+        bool negative = false;
+        if( pos < end && ( source[pos] == '-' || source[pos] == '+' ) ) {
+            negative = source[pos] == '-';
+            pos++;
+        }
+        if( pos == end ) {
+            return false;
+        }
+        int value = 0;
+        for( ; pos < end; pos++ ) {
+            if( source[pos] < '0' || source[pos] > '9' ) {
+                return false;
+            }
+            const int digit = source[pos] - '0';
+            if( value > ( INT_MAX - digit ) / 10 ) {
+                return false;
+            }
+            value = value * 10 + digit;
+        }
+        *p_value = negative ? -value : value;
+        return true;
+    }
+
+    // builds a CompiledTemplate's tree, from the tokens of its source
+    class Parser {
+    public:
+        CompiledTemplate &compiled;
+        Parser( CompiledTemplate &compiled ) :
+            compiled( compiled ) {
+        }
+        std::string tokenText( const Token &token ) const {
+            return compiled.sourceCode.substr( token.start, token.length ).str();
+        }
+        bool tokenIs( const Token &token, const char *text ) const {
+            return compiled.sourceCode.substr( token.start, token.length ) == text;
+        }
+        // parses all of compiled.source
+        void parseSource() {
+            compiled.sourceCode = compiled.source->text();
+            compiled.root = new Root();
+            try {
+                TemplateLexer lexer( compiled.sourceCode );
+                parse( lexer, 0 );
+            } catch( ... ) {
+                delete compiled.root;
+                throw;
+            }
+        }
+        // parses input, one chunk at a time, and then keeps the text read as
+        // compiled.source
+        void parseChunked( ChunkedTemplateInput &input ) {
+            compiled.root = new Root();
+            try {
+                TemplateLexer lexer( StringRef(), false );
+                parse( lexer, &input );
+                // text doubles as it grows, so may have as much again spare,
+                // which the compiled template would keep for as long as it lives
+                if( input.text.capacity() - input.text.size() > input.chunkSize ) {
+                    input.text.shrink_to_fit();
+                }
+                compiled.source = TemplateSource::fromString( std::move( input.text ) );
+                compiled.sourceCode = compiled.source->text();
+            } catch( ... ) {
+                delete compiled.root;
+                throw;
+            }
+        }
+        // builds the tree under compiled.root, from the tokens of sourceCode.
+        // Sections whose end tag hasnt been reached yet are kept on a stack,
+        // rather than recursing, so deeply nested templates dont use up the
+        // call stack.  If input isnt null, lexer starts out empty, and is fed
+        // from input, one chunk at a time
+        void parse( TemplateLexer &lexer, ChunkedTemplateInput *input ) {
+            vector< ControlSection * > stack( 1, compiled.root );
+            vector< Token > words;
+            Code *code = 0; // receives text and variables, until the next {% %} tag
+            size_t codeEnd = 0;
+            while( true ) {
+                const size_t tokenStart = lexer.pos; // variable tokens start after the {{
+                Token token = lexer.next();
+                if( token.type == Token::Text || token.type == Token::Variable ) {
+                    if( code == 0 ) {
+                        code = new Code( compiled.sourceCode, tokenStart );
+                        stack.back()->sections.push_back( code );
+                    }
+                    if( token.type == Token::Text ) {
+                        code->addLiteral( token.start, token.length );
+                    } else {
+                        code->addVariable( token.start, token.length, compiled.slots );
+                    }
+                    codeEnd = lexer.pos;
+                } else if( token.type == Token::NeedMore ) {
+                    // input.text may move when it grows, so sourceCode, and the
+                    // lexer, are refreshed after each read; the tree only holds
+                    // offsets into it
+                    lexer.complete = !input->readMore();
+                    compiled.sourceCode = StringRef( input->text );
+                    lexer.source = compiled.sourceCode;
+                } else if( token.type == Token::BlockBegin ) {
+                    if( code != 0 ) {
+                        code->finish( codeEnd );
+                        code = 0;
+                    }
+                    words.clear();
+                    Token word = lexer.next();
+                    while( word.type != Token::BlockEnd ) {
+                        words.push_back( word );
+                        word = lexer.next();
+                    }
+                    parseStatement( token, words, word, stack );
+                } else {
+                    if( code != 0 ) {
+                        code->finish( codeEnd );
+                    }
+                    if( stack.size() > 1 ) {
+                        ForSection *forSection = dynamic_cast< ForSection * >( stack.back() );
+                        throw render_error( string("No control end section found, expected '") + ( forSection != 0 ? "{% endfor %}" : "{% endif %}" ) + "', got end of template" );
+                    }
+                    return;
+                }
+            }
+        }
+        // stack holds root, and the sections enclosing a new one
+        void checkNesting( const std::vector< ControlSection * > &stack, StringRef controlChange ) const {
+            const size_t maxDepth = CompiledTemplate::maxNestingDepth;
+            if( stack.size() > maxDepth ) {
+                throw render_error( "control section {% " + controlChange.str() + " nested more than "
+                    + toString( (int)maxDepth ) + " deep" );
+            }
+        }
+        // handles one {% %} tag, whose contents are words
+        void parseStatement( const Token &blockBegin, const std::vector< Token > &words, const Token &blockEnd, std::vector< ControlSection * > &stack ) {
+            const size_t contentStart = blockBegin.start + 2;
+            // only copied into a string when theres an error to report
+            const StringRef controlChange = trimRef( compiled.sourceCode.substr( contentStart, blockEnd.start - contentStart ) );
+            if( words.size() == 0 ) {
+                throw render_error("control section {% " + controlChange.str() + " unexpected" );
+            }
+            if( tokenIs( words[0], "endfor" ) || tokenIs( words[0], "endif" ) ) {
+                if( words.size() != 1 ) {
+                    throw render_error("control section {% " + controlChange.str() + " unrecognized" );
+                }
+                if( stack.size() == 1 ) {
+                    throw render_error("some sourcecode found at end: " + compiled.sourceCode.substr( blockBegin.start ).str() );
+                }
+                const string controlEnd = compiled.sourceCode.substr( blockBegin.start, blockEnd.start + 2 - blockBegin.start ).str();
+                ForSection *forSection = dynamic_cast< ForSection * >( stack.back() );
+                if( forSection != 0 ) {
+                    if( !tokenIs( words[0], "endfor" ) ) {
+                        throw render_error("No control end section found, expected '{% endfor %}', got '" + controlEnd + "'" );
+                    }
+                    forSection->endPos = blockEnd.start + 2;
+                } else if( !tokenIs( words[0], "endif" ) ) {
+                    throw render_error("No control end section found, expected '{% endif %}', got '" + controlEnd + "'");
+                }
+                stack.pop_back();
+            } else if( tokenIs( words[0], "for" ) ) {
+                if( words.size() < 3 || words[1].type != Token::Name || !tokenIs( words[2], "in" ) ) {
+                    throw render_error("control section {% " + controlChange.str() + " unexpected: second word should be 'in'" );
+                }
+                if( words.size() < 4 || !tokenIs( words[3], "range" ) ) {
+                    throw render_error("control section {% " + controlChange.str() + " unexpected: third word should start with 'range'" );
+                }
+                if( words.size() != 7 || words[4].type != Token::LeftParen || words[5].type != Token::Name || words[6].type != Token::RightParen ) {
+                    throw render_error("control section " + controlChange.str() + " unexpected: should be in format 'range(somevar)' or 'range(somenumber)'" );
+                }
+                int endValue = 0;
+                string endName = "";
+                if( !parseInt( compiled.sourceCode, words[5].start, words[5].length, &endValue ) ) {
+                    // a variable: its value is looked up each time the loop is rendered
+                    endName = tokenText( words[5] );
+                }
+                checkNesting( stack, controlChange );
+                int beginValue = 0; // default for now...
+                ForSection *forSection = new ForSection();
+                forSection->startPos = blockEnd.start + 2;
+                forSection->endPos = forSection->startPos;
+                forSection->loopStart = beginValue;
+                forSection->loopEnd = endValue;
+                forSection->loopEndName = endName;
+                forSection->loopEndSlot = endName == "" ? -1 : compiled.slots.intern( endName );
+                forSection->varName = tokenText( words[1] );
+                forSection->varSlot = compiled.slots.intern( forSection->varName );
+                stack.back()->sections.push_back( forSection );
+                stack.push_back( forSection );
+            } else if( tokenIs( words[0], "if" ) ) {
+                checkNesting( stack, controlChange );
+                IfSection *ifSection = new IfSection( compiled.sourceCode, words, compiled.slots );
+                stack.back()->sections.push_back( ifSection );
+                stack.push_back( ifSection );
+            } else {
+                throw render_error("control section {% " + controlChange.str() + " unexpected" );
+            }
+        }
+    };
+}
+
+CompiledTemplate::CompiledTemplate( std::string sourceCode ) :
+    source( TemplateSource::fromString( std::move( sourceCode ) ) ) {
+    Parser( *this ).parseSource();
+}
+CompiledTemplate::CompiledTemplate( std::shared_ptr< const TemplateSource > source ) :
+    source( source ) {
+    Parser( *this ).parseSource();
+}
+namespace {
+    size_t readFromStream( void *userData, char *buffer, size_t size ) {
+        std::istream *in = (std::istream *)userData;
+        in->read( buffer, size );
+        return (size_t)in->gcount();
+    }
+}
+// reads in, chunkSize bytes at a time, parsing each chunk as it arrives.  The
+// tree points into the text, so all of it is kept, in input.text; if in can
+// tell how much is left, eg a file, that is allocated once, up front, at its
+// final size, plus a byte for readMore to find the end of the stream in
+CompiledTemplate::CompiledTemplate( std::istream &in, size_t chunkSize ) {
+    ChunkedTemplateInput input( readFromStream, &in, chunkSize );
+    const std::streampos start = in.tellg();
+    if( start != std::streampos( -1 ) ) {
+        const std::streampos end = in.seekg( 0, std::ios::end ).tellg();
+        in.clear();
+        in.seekg( start );
+        if( end > start ) {
+            input.text.reserve( (size_t)( end - start ) + 1 );
+        }
+    }
+    Parser( *this ).parseChunked( input );
+}
+CompiledTemplate::CompiledTemplate( ChunkedTemplateInput::ReadCallback read, void *userData, size_t chunkSize ) {
+    ChunkedTemplateInput input( read, userData, chunkSize );
+    Parser( *this ).parseChunked( input );
+}
+
+VIRTUAL CompiledTemplate::~CompiledTemplate() {
+    delete root;
+}
+std::string CompiledTemplate::render( const std::map< std::string, Value > &valueByName ) const {
+    vector< const Value * > valueBySlot = slots.bind( valueByName );
+    return render( valueBySlot );
+}
+// valueBySlot should have one entry per slot in slots, as returned by slots.bind
+std::string CompiledTemplate::render( std::vector< const Value * > &valueBySlot ) const {
+    string result = "";
+    renderInto( valueBySlot, result );
+    return result;
+}
+void CompiledTemplate::render( std::vector< const Value * > &valueBySlot, OutputSink &out, const RenderOptions &options ) const {
+    root->render(valueBySlot, out, options);
+}
+// replaces the contents of buffer with the rendered output.  buffer keeps its
+// capacity, so rendering into the same buffer again doesnt need to allocate.
+// Context::renderInto also reserves fresh buffers up front
+void CompiledTemplate::renderInto( std::vector< const Value * > &valueBySlot, std::string &buffer, const RenderOptions &options ) const {
+    buffer.clear();
+    StringSink sink( buffer );
+    render( valueBySlot, sink, options );
+}
+void CompiledTemplate::print() const {
+    root->print("");
+}
+
+// serialized compiled templates are laid out as:
+//
+//     "J2CL", version, slot names, source, root's child count, nodes
+//
+// where the nodes are the tree in preorder, each a node type, a child count,
+// and the fields for that type.  Ints are little endian, strings are a length
+// and the chars.  Everything in the tree that points into the source is an
+// offset, so the blob can be loaded from anywhere, and the source is used in
+// place, rather than copied out of it
+namespace {
+    const char blobMagic[] = "J2CL";
+    const uint32_t blobVersion = 1;
+    enum BlobNodeType {
+        BlobCode = 1,
+        BlobFor = 2,
+        BlobIf = 3
+    };
+
+    class BlobWriter {
+    public:
+        std::string &out;
+        BlobWriter( std::string &out ) :
+            out( out ) {
+        }
+        void writeU8( uint8_t value ) {
+            out += (char)value;
+        }
+        void writeU32( uint32_t value ) {
+            for( int i = 0; i < 4; i++ ) {
+                out += (char)( ( value >> ( 8 * i ) ) & 0xff );
+            }
+        }
+        void writeU64( uint64_t value ) {
+            for( int i = 0; i < 8; i++ ) {
+                out += (char)( ( value >> ( 8 * i ) ) & 0xff );
+            }
+        }
+        void writeI32( int value ) {
+            writeU32( (uint32_t)value );
+        }
+        void writeString( StringRef value ) {
+            writeU64( value.length );
+            out.append( value.data, value.length );
+        }
+        void writeSection( ControlSection *section ) {
+            if( Code *code = dynamic_cast< Code * >( section ) ) {
+                writeU8( BlobCode );
+                writeU32( (uint32_t)code->sections.size() );
+                writeU64( code->startPos );
+                writeU64( code->endPos );
+                writeU32( (uint32_t)code->segments.size() );
+                for( size_t i = 0; i < code->segments.size(); i++ ) {
+                    const CodeSegment &segment = code->segments[i];
+                    writeU64( segment.literalStart );
+                    writeU64( segment.literalLength );
+                    writeU8( segment.hasVariable ? 1 : 0 );
+                    if( segment.hasVariable ) {
+                        writeU64( segment.nameStart );
+                        writeU64( segment.nameLength );
+                        writeI32( segment.slot );
+                    }
+                }
+            } else if( ForSection *forSection = dynamic_cast< ForSection * >( section ) ) {
+                writeU8( BlobFor );
+                writeU32( (uint32_t)forSection->sections.size() );
+                writeI32( forSection->loopStart );
+                writeI32( forSection->loopEnd );
+                writeI32( forSection->loopEndSlot );
+                writeI32( forSection->varSlot );
+                writeU64( forSection->startPos );
+                writeU64( forSection->endPos );
+            } else if( IfSection *ifSection = dynamic_cast< IfSection * >( section ) ) {
+                writeU8( BlobIf );
+                writeU32( (uint32_t)ifSection->sections.size() );
+                writeU8( ifSection->isNegation() ? 1 : 0 );
+                writeI32( ifSection->slot() );
+                writeString( ifSection->variableName() );
+            } else {
+                throw render_error( "cant serialize section" );
+            }
+            for( size_t i = 0; i < section->sections.size(); i++ ) {
+                writeSection( section->sections[i] );
+            }
+        }
+    };
+
+    // checks everything it reads, so a truncated or corrupt blob gives a
+    // render_error, rather than a tree that reads out of bounds when rendered
+    class BlobReader {
+    public:
+        StringRef blob;
+        size_t pos;
+        BlobReader( StringRef blob ) :
+            blob( blob ),
+            pos( 0 ) {
+        }
+        void need( size_t size ) {
+            if( size > blob.length - pos ) {
+                throw render_error( "compiled template truncated" );
+            }
+        }
+        uint8_t readU8() {
+            need( 1 );
+            return (uint8_t)blob[pos++];
+        }
+        uint32_t readU32() {
+            need( 4 );
+            uint32_t value = 0;
+            for( int i = 0; i < 4; i++ ) {
+                value |= (uint32_t)(uint8_t)blob[pos++] << ( 8 * i );
+            }
+            return value;
+        }
+        uint64_t readU64() {
+            need( 8 );
+            uint64_t value = 0;
+            for( int i = 0; i < 8; i++ ) {
+                value |= (uint64_t)(uint8_t)blob[pos++] << ( 8 * i );
+            }
+            return value;
+        }
+        int readI32() {
+            return (int)readU32();
+        }
+        // an offset or length within something of size limit
+        size_t readSize( size_t limit ) {
+            const uint64_t value = readU64();
+            if( value > limit ) {
+                throw render_error( "compiled template corrupt: offset out of range" );
+            }
+            return (size_t)value;
+        }
+        StringRef readString() {
+            const size_t length = readSize( blob.length );
+            need( length );
+            StringRef value = blob.substr( pos, length );
+            pos += length;
+            return value;
+        }
+        // a slot, which must be less than numSlots, or, if allowNone, -1
+        int readSlot( int numSlots, bool allowNone ) {
+            const int slot = readI32();
+            if( slot >= numSlots || slot < ( allowNone ? -1 : 0 ) ) {
+                throw render_error( "compiled template corrupt: slot out of range" );
+            }
+            return slot;
+        }
+    };
+}
+
+// a compact binary form of this template, which load() turns back into a
+// CompiledTemplate, without parsing the source again
+std::string CompiledTemplate::serialize() const {
+    std::string blob;
+    BlobWriter writer( blob );
+    blob.append( blobMagic, 4 );
+    writer.writeU32( blobVersion );
+    writer.writeU32( (uint32_t)slots.names.size() );
+    for( size_t i = 0; i < slots.names.size(); i++ ) {
+        writer.writeString( slots.names[i] );
+    }
+    writer.writeString( sourceCode );
+    writer.writeU32( (uint32_t)root->sections.size() );
+    for( size_t i = 0; i < root->sections.size(); i++ ) {
+        writer.writeSection( root->sections[i] );
+    }
+    return blob;
+}
+// blob is as returned by serialize(), eg read from a file with
+// TemplateSource::mapFile.  The returned template refers to the source
+// inside blob, so it shares ownership of it
+STATIC std::shared_ptr< const CompiledTemplate > CompiledTemplate::load( std::shared_ptr< const TemplateSource > blob ) {
+    BlobReader reader( blob->text() );
+    reader.need( 4 );
+    if( memcmp( blob->data, blobMagic, 4 ) != 0 ) {
+        throw render_error( "not a compiled template" );
+    }
+    reader.pos = 4;
+    const uint32_t version = reader.readU32();
+    if( version != blobVersion ) {
+        throw render_error( "compiled template version " + toString( version ) + " not supported, expected " + toString( blobVersion ) );
+    }
+    // not make_shared, since the default constructor is private
+    std::shared_ptr< CompiledTemplate > compiled( new CompiledTemplate() );
+    compiled->root = new Root();
+    compiled->source = blob;
+    const uint32_t numSlots = reader.readU32();
+    for( uint32_t i = 0; i < numSlots; i++ ) {
+        if( compiled->slots.intern( reader.readString().str() ) != (int)i ) {
+            throw render_error( "compiled template corrupt: duplicate slot name" );
+        }
+    }
+    compiled->sourceCode = reader.readString();
+    const size_t sourceLength = compiled->sourceCode.length;
+    // the sections whose children are still to be read, and how many are left for each
+    vector< ControlSection * > stack( 1, compiled->root );
+    vector< uint32_t > remaining( 1, reader.readU32() );
+    while( stack.size() > 0 ) {
+        if( remaining.back() == 0 ) {
+            stack.pop_back();
+            remaining.pop_back();
+            continue;
+        }
+        remaining.back()--;
+        const uint8_t type = reader.readU8();
+        const uint32_t numChildren = reader.readU32();
+        // code sections are leaves, so can be one level below the deepest
+        // control section the parser allows, but no further
+        if( type == BlobCode && numChildren != 0 ) {
+            throw render_error( "compiled template corrupt: code section with children" );
+        }
+        if( stack.size() > ( type == BlobCode ? maxNestingDepth + 1 : maxNestingDepth ) ) {
+            throw render_error( "compiled template corrupt: sections nested too deeply" );
+        }
+        ControlSection *section = 0;
+        if( type == BlobCode ) {
+            Code *code = new Code( compiled->sourceCode, 0 );
+            section = code;
+            stack.back()->sections.push_back( code );
+            code->startPos = reader.readSize( sourceLength );
+            code->endPos = reader.readSize( sourceLength );
+            const uint32_t numSegments = reader.readU32();
+            reader.need( numSegments ); // at least a byte each, so a corrupt count cant allocate much
+            code->segments.resize( numSegments );
+            for( uint32_t i = 0; i < numSegments; i++ ) {
+                CodeSegment &segment = code->segments[i];
+                segment.literalStart = reader.readSize( sourceLength );
+                segment.literalLength = reader.readSize( sourceLength - segment.literalStart );
+                segment.hasVariable = reader.readU8() != 0;
+                segment.nameStart = 0;
+                segment.nameLength = 0;
+                segment.slot = -1;
+                if( segment.hasVariable ) {
+                    segment.nameStart = reader.readSize( sourceLength );
+                    segment.nameLength = reader.readSize( sourceLength - segment.nameStart );
+                    segment.slot = reader.readSlot( numSlots, false );
+                }
+            }
+        } else if( type == BlobFor ) {
+            ForSection *forSection = new ForSection();
+            section = forSection;
+            stack.back()->sections.push_back( forSection );
+            forSection->loopStart = reader.readI32();
+            forSection->loopEnd = reader.readI32();
+            forSection->loopEndSlot = reader.readSlot( numSlots, true );
+            forSection->loopEndName = forSection->loopEndSlot == -1 ? "" : compiled->slots.names[forSection->loopEndSlot];
+            forSection->varSlot = reader.readSlot( numSlots, false );
+            forSection->varName = compiled->slots.names[forSection->varSlot];
+            forSection->startPos = reader.readSize( sourceLength );
+            forSection->endPos = reader.readSize( sourceLength );
+        } else if( type == BlobIf ) {
+            const bool isNegation = reader.readU8() != 0;
+            const int slot = reader.readSlot( numSlots, true );
+            const string variableName = reader.readString().str();
+            // only True and False have no slot
+            if( ( slot == -1 ) != ( variableName == JINJA2_TRUE || variableName == JINJA2_FALSE ) ) {
+                throw render_error( "compiled template corrupt: slot out of range" );
+            }
+            section = new IfSection( isNegation, variableName, slot );
+            stack.back()->sections.push_back( section );
+        } else {
+            throw render_error( "compiled template corrupt: unknown section type " + toString( (int)type ) );
+        }
+        stack.push_back( section );
+        remaining.push_back( numChildren );
+    }
+    if( reader.pos != reader.blob.length ) {
+        throw render_error( "compiled template corrupt: unexpected data at end" );
+    }
+    return compiled;
+}
+
+// bundles are laid out as:
+//
+//     "J2CB", version, number of entries, number of buckets, buckets, entries, data
+//
+// buckets is an open addressing hash table, probed linearly from
+// hash & ( numBuckets - 1 ), each bucket holding an entry index plus one, or
+// zero if empty.  Each entry is the name's hash, then the offset and length in
+// the blob of the name, and of the serialized template.  Like serialized
+// templates, everything is little endian, and offsets are from the start of
+// the blob
+namespace {
+    const char bundleMagic[] = "J2CB";
+    const uint32_t bundleVersion = 1;
+    const size_t bundleHeaderSize = 16;
+    const size_t bundleBucketSize = 4;
+    const size_t bundleEntrySize = 40;
+
+    // 64-bit FNV-1a
+    uint64_t hashName( StringRef name ) {
+        uint64_t hash = 14695981039346656037ULL;
+        for( size_t i = 0; i < name.length; i++ ) {
+            hash ^= (uint8_t)name[i];
+            hash *= 1099511628211ULL;
+        }
+        return hash;
+    }
+    uint32_t readU32At( StringRef blob, size_t pos ) {
+        uint32_t value = 0;
+        for( int i = 0; i < 4; i++ ) {
+            value |= (uint32_t)(uint8_t)blob[pos + i] << ( 8 * i );
+        }
+        return value;
+    }
+    uint64_t readU64At( StringRef blob, size_t pos ) {
+        uint64_t value = 0;
+        for( int i = 0; i < 8; i++ ) {
+            value |= (uint64_t)(uint8_t)blob[pos + i] << ( 8 * i );
+        }
+        return value;
+    }
+}
+
+void TemplateBundleWriter::add( const std::string &name, const CompiledTemplate &compiled ) {
+    for( size_t i = 0; i < names.size(); i++ ) {
+        if( names[i] == name ) {
+            throw render_error( "template " + name + " already in bundle" );
+        }
+    }
+    names.push_back( name );
+    blobs.push_back( compiled.serialize() );
+}
+std::string TemplateBundleWriter::serialize() const {
+    size_t numBuckets = 1;
+    while( numBuckets < names.size() * 2 ) {
+        numBuckets *= 2;
+    }
+    vector< uint32_t > buckets( numBuckets, 0 );
+    for( size_t i = 0; i < names.size(); i++ ) {
+        size_t bucket = (size_t)hashName( names[i] ) & ( numBuckets - 1 );
+        while( buckets[bucket] != 0 ) {
+            bucket = ( bucket + 1 ) & ( numBuckets - 1 );
+        }
+        buckets[bucket] = (uint32_t)( i + 1 );
+    }
+    std::string blob;
+    BlobWriter writer( blob );
+    blob.append( bundleMagic, 4 );
+    writer.writeU32( bundleVersion );
+    writer.writeU32( (uint32_t)names.size() );
+    writer.writeU32( (uint32_t)numBuckets );
+    for( size_t i = 0; i < numBuckets; i++ ) {
+        writer.writeU32( buckets[i] );
+    }
+    uint64_t dataOffset = bundleHeaderSize + numBuckets * bundleBucketSize + names.size() * bundleEntrySize;
+    for( size_t i = 0; i < names.size(); i++ ) {
+        writer.writeU64( hashName( names[i] ) );
+        writer.writeU64( dataOffset );
+        writer.writeU64( names[i].size() );
+        dataOffset += names[i].size();
+        writer.writeU64( dataOffset );
+        writer.writeU64( blobs[i].size() );
+        dataOffset += blobs[i].size();
+    }
+    for( size_t i = 0; i < names.size(); i++ ) {
+        blob += names[i];
+        blob += blobs[i];
+    }
+    return blob;
+}
+
+// checks the header and the index, up front, so lookups can trust them.  The
+// templates themselves are only checked when loaded
+TemplateBundle::TemplateBundle( std::shared_ptr< const TemplateSource > blob ) :
+    blob( blob ) {
+    const StringRef text = blob->text();
+    if( text.length < bundleHeaderSize || memcmp( text.data, bundleMagic, 4 ) != 0 ) {
+        throw render_error( "not a template bundle" );
+    }
+    const uint32_t version = readU32At( text, 4 );
+    if( version != bundleVersion ) {
+        throw render_error( "template bundle version " + toString( version ) + " not supported, expected " + toString( bundleVersion ) );
+    }
+    numEntries = readU32At( text, 8 );
+    numBuckets = readU32At( text, 12 );
+    bucketsOffset = bundleHeaderSize;
+    entriesOffset = bucketsOffset + numBuckets * bundleBucketSize;
+    if( numBuckets == 0 || ( numBuckets & ( numBuckets - 1 ) ) != 0 || numBuckets < numEntries
+            || numBuckets > ( text.length - bundleHeaderSize ) / bundleBucketSize
+            || numEntries > ( text.length - entriesOffset ) / bundleEntrySize ) {
+        throw render_error( "template bundle corrupt: bad index" );
+    }
+    for( size_t i = 0; i < numBuckets; i++ ) {
+        if( readU32At( text, bucketsOffset + i * bundleBucketSize ) > numEntries ) {
+            throw render_error( "template bundle corrupt: bad index" );
+        }
+    }
+    for( size_t i = 0; i < numEntries; i++ ) {
+        const size_t entry = entriesOffset + i * bundleEntrySize;
+        for( size_t field = 8; field < bundleEntrySize; field += 16 ) {
+            const uint64_t offset = readU64At( text, entry + field );
+            const uint64_t length = readU64At( text, entry + field + 8 );
+            if( offset > text.length || length > text.length - offset ) {
+                throw render_error( "template bundle corrupt: entry out of range" );
+            }
+        }
+    }
+}
+size_t TemplateBundle::size() const {
+    return numEntries;
+}
+// names are in the order they were added
+std::string TemplateBundle::name( size_t index ) const {
+    return entryName( index ).str();
+}
+bool TemplateBundle::contains( const std::string &name ) const {
+    return findEntry( name ) >= 0;
+}
+// throws render_error if name isnt in the bundle
+std::shared_ptr< const CompiledTemplate > TemplateBundle::load( const std::string &name ) const {
+    const long long index = findEntry( name );
+    if( index < 0 ) {
+        throw render_error( "template " + name + " not found in bundle" );
+    }
+    const StringRef compiled = entryTemplate( (size_t)index );
+    return CompiledTemplate::load( TemplateSource::slice( blob, compiled.data - blob->data, compiled.length ) );
+}
+// index of the entry for name, or -1
+long long TemplateBundle::findEntry( const std::string &name ) const {
+    const StringRef text = blob->text();
+    const uint64_t hash = hashName( name );
+    size_t bucket = (size_t)hash & ( numBuckets - 1 );
+    // at most numBuckets probes, in case a corrupt bundle has no empty bucket
+    for( size_t probe = 0; probe < numBuckets; probe++ ) {
+        const uint32_t entryPlusOne = readU32At( text, bucketsOffset + bucket * bundleBucketSize );
+        if( entryPlusOne == 0 ) {
+            return -1;
+        }
+        const size_t index = entryPlusOne - 1;
+        if( readU64At( text, entriesOffset + index * bundleEntrySize ) == hash && entryName( index ) == name ) {
+            return (long long)index;
+        }
+        bucket = ( bucket + 1 ) & ( numBuckets - 1 );
+    }
+    return -1;
+}
+StringRef TemplateBundle::entryName( size_t index ) const {
+    const StringRef text = blob->text();
+    const size_t entry = entriesOffset + index * bundleEntrySize;
+    return text.substr( (size_t)readU64At( text, entry + 8 ), (size_t)readU64At( text, entry + 16 ) );
+}
+StringRef TemplateBundle::entryTemplate( size_t index ) const {
+    const StringRef text = blob->text();
+    const size_t entry = entriesOffset + index * bundleEntrySize;
+    return text.substr( (size_t)readU64At( text, entry + 24 ), (size_t)readU64At( text, entry + 32 ) );
+}
+
+}
@@ -0,0 +1,449 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// floats are converted exactly, using the digit generation algorithm from
+// Burger and Dybvig, "Printing Floating-Point Numbers Quickly and Accurately",
+// on a small fixed-size big integer, which is plenty for the range of a float
+
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+
+#include "numberformat.h"
+
+namespace {
+
+const char digitPairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// unsigned integer, up to MaxWords * 32 bits, least significant word first
+class BigInt {
+public:
+    static const int MaxWords = 10;
+    uint32_t words[MaxWords];
+    int numWords;
+
+    BigInt( uint32_t value ) {
+        words[0] = value;
+        numWords = value == 0 ? 0 : 1;
+    }
+    void multiply( uint32_t factor ) {
+        uint64_t carry = 0;
+        for( int i = 0; i < numWords; i++ ) {
+            uint64_t product = (uint64_t)words[i] * factor + carry;
+            words[i] = (uint32_t)product;
+            carry = product >> 32;
+        }
+        if( carry != 0 ) {
+            words[numWords++] = (uint32_t)carry;
+        }
+    }
+    void multiplyByPow10( int exponent ) {
+        while( exponent >= 9 ) {
+            multiply( 1000000000 );
+            exponent -= 9;
+        }
+        static const uint32_t smallPow10[] = { 1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000 };
+        if( exponent > 0 ) {
+            multiply( smallPow10[exponent] );
+        }
+    }
+    void shiftLeft( int bits ) {
+        if( numWords == 0 ) {
+            return;
+        }
+        int wordShift = bits / 32;
+        int bitShift = bits % 32;
+        if( bitShift != 0 ) {
+            uint32_t carry = 0;
+            for( int i = 0; i < numWords; i++ ) {
+                uint32_t word = words[i];
+                words[i] = ( word << bitShift ) | carry;
+                carry = word >> ( 32 - bitShift );
+            }
+            if( carry != 0 ) {
+                words[numWords++] = carry;
+            }
+        }
+        if( wordShift != 0 ) {
+            for( int i = numWords - 1; i >= 0; i-- ) {
+                words[i + wordShift] = words[i];
+            }
+            for( int i = 0; i < wordShift; i++ ) {
+                words[i] = 0;
+            }
+            numWords += wordShift;
+        }
+    }
+    void add( const BigInt &other ) {
+        uint64_t carry = 0;
+        int n = numWords > other.numWords ? numWords : other.numWords;
+        for( int i = 0; i < n; i++ ) {
+            uint64_t sum = carry + ( i < numWords ? words[i] : 0 ) + ( i < other.numWords ? other.words[i] : 0 );
+            words[i] = (uint32_t)sum;
+            carry = sum >> 32;
+        }
+        numWords = n;
+        if( carry != 0 ) {
+            words[numWords++] = (uint32_t)carry;
+        }
+    }
+    // other must not be larger than this
+    void subtract( const BigInt &other ) {
+        int64_t borrow = 0;
+        for( int i = 0; i < numWords; i++ ) {
+            int64_t difference = (int64_t)words[i] - ( i < other.numWords ? other.words[i] : 0 ) - borrow;
+            borrow = difference < 0 ? 1 : 0;
+            words[i] = (uint32_t)( difference + ( borrow << 32 ) );
+        }
+        while( numWords > 0 && words[numWords - 1] == 0 ) {
+            numWords--;
+        }
+    }
+    static int compare( const BigInt &one, const BigInt &two ) {
+        if( one.numWords != two.numWords ) {
+            return one.numWords < two.numWords ? -1 : 1;
+        }
+        for( int i = one.numWords - 1; i >= 0; i-- ) {
+            if( one.words[i] != two.words[i] ) {
+                return one.words[i] < two.words[i] ? -1 : 1;
+            }
+        }
+        return 0;
+    }
+    // compares one + two with three
+    static int compareSum( const BigInt &one, const BigInt &two, const BigInt &three ) {
+        BigInt sum = one;
+        sum.add( two );
+        return compare( sum, three );
+    }
+    // divides by divisor, where the result is known to be less than 10,
+    // leaving the remainder in this
+    int divideSmall( const BigInt &divisor ) {
+        int quotient = 0;
+        if( numWords == 0 || numWords < divisor.numWords ) {
+            return 0;
+        }
+        // start from an underestimate, based on the leading words
+        int n = divisor.numWords;
+        uint64_t top = numWords > n ? ( (uint64_t)words[n] << 32 ) | words[n - 1] : words[n - 1];
+        uint64_t estimate = top / ( (uint64_t)divisor.words[n - 1] + 1 );
+        if( estimate > 0 ) {
+            BigInt product = divisor;
+            product.multiply( (uint32_t)estimate );
+            subtract( product );
+            quotient = (int)estimate;
+        }
+        while( compare( *this, divisor ) >= 0 ) {
+            subtract( divisor );
+            quotient++;
+        }
+        return quotient;
+    }
+};
+
+// the parts of a finite, non-zero float: value = mantissa * 2^exponent
+void decompose( float value, uint32_t *p_mantissa, int *p_exponent, bool *p_unequalGaps ) {
+    uint32_t bits;
+    memcpy( &bits, &value, sizeof( bits ) );
+    uint32_t biasedExponent = ( bits >> 23 ) & 0xff;
+    uint32_t fraction = bits & 0x7fffff;
+    if( biasedExponent == 0 ) {
+        *p_mantissa = fraction;
+        *p_exponent = -149;
+    } else {
+        *p_mantissa = fraction | 0x800000;
+        *p_exponent = (int)biasedExponent - 150;
+    }
+    // the gap to the next float down is half the gap to the next one up
+    *p_unequalGaps = fraction == 0 && biasedExponent > 1;
+}
+
+int bitLength( uint32_t value ) {
+    int length = 0;
+    while( value != 0 ) {
+        length++;
+        value >>= 1;
+    }
+    return length;
+}
+
+// sets up value = r / s * 10^k, with r < s, and returns k
+int scale( uint32_t mantissa, int exponent, BigInt *r, BigInt *s, BigInt *mPlus, BigInt *mMinus, bool highInclusive ) {
+    // estimate of ceil( log10( value ) ), which is either right or one too small
+    int k = (int)std::ceil( ( exponent + bitLength( mantissa ) - 1 ) * 0.30102999566398119521 - 1e-10 );
+    if( k >= 0 ) {
+        s->multiplyByPow10( k );
+    } else {
+        r->multiplyByPow10( -k );
+        mPlus->multiplyByPow10( -k );
+        mMinus->multiplyByPow10( -k );
+    }
+    int cmp = BigInt::compareSum( *r, *mPlus, *s );
+    if( cmp > 0 || ( highInclusive && cmp == 0 ) ) {
+        s->multiply( 10 );
+        k++;
+    }
+    return k;
+}
+
+// writes the decimal digits of value, as chars, to digits, and returns how
+// many; value = 0.digits * 10^(*p_k)
+int shortestDigits( float value, char *digits, int *p_k ) {
+    uint32_t mantissa;
+    int exponent;
+    bool unequalGaps;
+    decompose( value, &mantissa, &exponent, &unequalGaps );
+    // everything is doubled, so that the half-gaps to the neighbouring floats,
+    // mMinus and mPlus, are integers
+    BigInt r( mantissa );
+    BigInt s( 1 );
+    BigInt mPlus( 1 );
+    BigInt mMinus( 1 );
+    if( exponent >= 0 ) {
+        r.shiftLeft( exponent + 1 );
+        s.shiftLeft( 1 );
+        mPlus.shiftLeft( exponent );
+        mMinus.shiftLeft( exponent );
+    } else {
+        r.shiftLeft( 1 );
+        s.shiftLeft( 1 - exponent );
+    }
+    if( unequalGaps ) {
+        r.shiftLeft( 1 );
+        s.shiftLeft( 1 );
+        mPlus.shiftLeft( 1 );
+    }
+    // reading back rounds half to even, so if the mantissa is even, a decimal
+    // exactly halfway to a neighbour still reads back as value
+    bool even = ( mantissa & 1 ) == 0;
+    *p_k = scale( mantissa, exponent, &r, &s, &mPlus, &mMinus, even );
+    int numDigits = 0;
+    while( true ) {
+        r.multiply( 10 );
+        mPlus.multiply( 10 );
+        mMinus.multiply( 10 );
+        int digit = r.divideSmall( s );
+        int lowCmp = BigInt::compare( r, mMinus );
+        int highCmp = BigInt::compareSum( r, mPlus, s );
+        bool low = lowCmp < 0 || ( even && lowCmp == 0 );
+        bool high = highCmp > 0 || ( even && highCmp == 0 );
+        if( !low && !high ) {
+            digits[numDigits++] = (char)( '0' + digit );
+            continue;
+        }
+        if( low && high ) {
+            // either would read back correctly; pick the closer one
+            BigInt twiceR = r;
+            twiceR.shiftLeft( 1 );
+            int cmp = BigInt::compare( twiceR, s );
+            if( cmp > 0 || ( cmp == 0 && digit % 2 == 1 ) ) {
+                digit++;
+            }
+        } else if( high ) {
+            digit++;
+        }
+        digits[numDigits++] = (char)( '0' + digit );
+        return numDigits;
+    }
+}
+
+// writes the first numDigits decimal digits of value, correctly rounded, to
+// digits, and returns how many were written, which may be numDigits + 1 if
+// rounding carried into a new leading digit; value = 0.digits * 10^(*p_k)
+int fixedDigits( float value, int numDigits, char *digits, int *p_k ) {
+    uint32_t mantissa;
+    int exponent;
+    bool unequalGaps;
+    decompose( value, &mantissa, &exponent, &unequalGaps );
+    BigInt r( mantissa );
+    BigInt s( 1 );
+    BigInt zero( 0 );
+    if( exponent >= 0 ) {
+        r.shiftLeft( exponent );
+    } else {
+        s.shiftLeft( -exponent );
+    }
+    *p_k = scale( mantissa, exponent, &r, &s, &zero, &zero, true );
+    numDigits += *p_k;
+    if( numDigits < 0 ) {
+        // less than a tenth of a unit in the last place, so rounds to zero
+        return 0;
+    }
+    for( int i = 0; i < numDigits; i++ ) {
+        r.multiply( 10 );
+        digits[i] = (char)( '0' + r.divideSmall( s ) );
+    }
+    r.shiftLeft( 1 );
+    int cmp = BigInt::compare( r, s );
+    bool lastOdd = numDigits > 0 && ( digits[numDigits - 1] - '0' ) % 2 == 1;
+    if( cmp > 0 || ( cmp == 0 && lastOdd ) ) {
+        int i = numDigits - 1;
+        while( i >= 0 && digits[i] == '9' ) {
+            digits[i] = '0';
+            i--;
+        }
+        if( i >= 0 ) {
+            digits[i]++;
+        } else {
+            memmove( digits + 1, digits, numDigits );
+            digits[0] = '1';
+            numDigits++;
+            ( *p_k )++;
+        }
+    }
+    return numDigits;
+}
+
+int formatSpecial( float value, char *buffer, bool *p_handled ) {
+    *p_handled = true;
+    if( value != value ) {
+        memcpy( buffer, "nan", 3 );
+        return 3;
+    }
+    int pos = 0;
+    if( std::signbit( value ) ) {
+        buffer[pos++] = '-';
+    }
+    if( std::isinf( value ) ) {
+        memcpy( buffer + pos, "inf", 3 );
+        return pos + 3;
+    }
+    if( value == 0 ) {
+        buffer[pos++] = '0';
+        return pos;
+    }
+    *p_handled = false;
+    return pos;
+}
+
+}
+
+int formatInt( int value, char *buffer ) {
+    uint32_t magnitude = value < 0 ? 0u - (uint32_t)value : (uint32_t)value;
+    char reversed[FORMAT_INT_MAX_CHARS];
+    int numDigits = 0;
+    while( magnitude >= 100 ) {
+        int pair = (int)( magnitude % 100 ) * 2;
+        magnitude /= 100;
+        reversed[numDigits++] = digitPairs[pair + 1];
+        reversed[numDigits++] = digitPairs[pair];
+    }
+    if( magnitude >= 10 ) {
+        int pair = (int)magnitude * 2;
+        reversed[numDigits++] = digitPairs[pair + 1];
+        reversed[numDigits++] = digitPairs[pair];
+    } else {
+        reversed[numDigits++] = (char)( '0' + magnitude );
+    }
+    int pos = 0;
+    if( value < 0 ) {
+        buffer[pos++] = '-';
+    }
+    while( numDigits > 0 ) {
+        buffer[pos++] = reversed[--numDigits];
+    }
+    return pos;
+}
+
+int formatFloat( float value, char *buffer ) {
+    bool handled;
+    int pos = formatSpecial( value, buffer, &handled );
+    if( handled ) {
+        return pos;
+    }
+    char digits[12];
+    int k;
+    int numDigits = shortestDigits( value, digits, &k );
+    int decimalExponent = k - 1; // of the first digit
+    int positionalLimit = numDigits > 6 ? numDigits : 6;
+    if( decimalExponent >= -4 && decimalExponent < positionalLimit ) {
+        if( k <= 0 ) {
+            buffer[pos++] = '0';
+            buffer[pos++] = '.';
+            for( int i = 0; i < -k; i++ ) {
+                buffer[pos++] = '0';
+            }
+            memcpy( buffer + pos, digits, numDigits );
+            pos += numDigits;
+        } else if( k >= numDigits ) {
+            memcpy( buffer + pos, digits, numDigits );
+            pos += numDigits;
+            for( int i = numDigits; i < k; i++ ) {
+                buffer[pos++] = '0';
+            }
+        } else {
+            memcpy( buffer + pos, digits, k );
+            pos += k;
+            buffer[pos++] = '.';
+            memcpy( buffer + pos, digits + k, numDigits - k );
+            pos += numDigits - k;
+        }
+        return pos;
+    }
+    buffer[pos++] = digits[0];
+    if( numDigits > 1 ) {
+        buffer[pos++] = '.';
+        memcpy( buffer + pos, digits + 1, numDigits - 1 );
+        pos += numDigits - 1;
+    }
+    buffer[pos++] = 'e';
+    buffer[pos++] = decimalExponent < 0 ? '-' : '+';
+    int magnitude = decimalExponent < 0 ? -decimalExponent : decimalExponent;
+    buffer[pos++] = digitPairs[magnitude * 2];
+    buffer[pos++] = digitPairs[magnitude * 2 + 1];
+    return pos;
+}
+
+int formatFloatFixed( float value, int precision, char *buffer ) {
+    if( precision < 0 ) {
+        precision = 0;
+    }
+    if( precision > FORMAT_FLOAT_MAX_PRECISION ) {
+        precision = FORMAT_FLOAT_MAX_PRECISION;
+    }
+    bool handled;
+    int pos = formatSpecial( value, buffer, &handled );
+    char digits[FORMAT_FLOAT_FIXED_MAX_CHARS];
+    int numDigits = 0;
+    int k = 0;
+    if( handled ) {
+        if( value != value || std::isinf( value ) ) {
+            return pos;
+        }
+        pos--; // zero: overwrite the '0', and write it out below, with the decimal places
+    } else {
+        numDigits = fixedDigits( value, precision, digits, &k );
+    }
+    // digits holds the value, in units of 10^-precision, ie with
+    // numDigits - precision digits before the decimal point
+    int integerDigits = numDigits - precision;
+    if( integerDigits <= 0 ) {
+        buffer[pos++] = '0';
+    } else {
+        memcpy( buffer + pos, digits, integerDigits );
+        pos += integerDigits;
+    }
+    if( precision > 0 ) {
+        buffer[pos++] = '.';
+        for( int i = integerDigits; i < 0; i++ ) {
+            buffer[pos++] = '0';
+        }
+        int fractionStart = integerDigits > 0 ? integerDigits : 0;
+        memcpy( buffer + pos, digits + fractionStart, numDigits - fractionStart );
+        pos += numDigits - fractionStart;
+    }
+    return pos;
+}
@@ -0,0 +1,33 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// formats ints and floats into a caller-supplied char buffer, without
+// allocating, and without depending on the current locale, ie the decimal
+// point is always '.'.  None of these write a terminating null; they return
+// the number of chars written
+
+#pragma once
+
+// enough for any int, eg "-2147483648"
+const int FORMAT_INT_MAX_CHARS = 11;
+// enough for any float in shortest form, eg "-1.17549435e-38"
+const int FORMAT_FLOAT_MAX_CHARS = 16;
+// formatFloatFixed rounds to at most this many decimal places
+const int FORMAT_FLOAT_MAX_PRECISION = 60;
+// enough for any float in fixed form, with any precision
+const int FORMAT_FLOAT_FIXED_MAX_CHARS = 42 + FORMAT_FLOAT_MAX_PRECISION;
+
+int formatInt( int value, char *buffer );
+
+// shortest string that reads back as exactly the same float.  Uses the same
+// layout as printf's %g, or std::ostream's default: positional notation, eg
+// "12.123", "0.0001", "1234567", unless that would need padding with zeros,
+// in which case it switches to exponent notation, eg "1e+10", "1e-05"
+int formatFloat( float value, char *buffer );
+
+// like printf's %.*f, ie precision digits after the decimal point, correctly
+// rounded (half to even).  precision is clamped to FORMAT_FLOAT_MAX_PRECISION
+int formatFloatFixed( float value, int precision, char *buffer );
@@ -7,71 +7,213 @@
 #include <string>
 #include <vector>
 #include <sstream>
+#include <cstring>
 using namespace std;
 
 #include "stringhelper.h"
 
+const size_t StringRef::npos;
+
+size_t StringRef::find( StringRef value, size_t from ) const {
+    if( value.length == 0 ) {
+        return from <= length ? from : npos;
+    }
+    while( from + value.length <= length ) {
+        const char *first = (const char *)memchr( data + from, value.data[0], length - value.length - from + 1 );
+        if( first == 0 ) {
+            return npos;
+        }
+        from = first - data;
+        if( memcmp( first + 1, value.data + 1, value.length - 1 ) == 0 ) {
+            return from;
+        }
+        from++;
+    }
+    return npos;
+}
+
+SplitIterator::SplitIterator( StringRef str, StringRef separator ) :
+    str( str ),
+    separator( separator ),
+    pos( 0 ),
+    finished( false ) {
+}
+bool SplitIterator::next( StringRef &piece ) {
+    if( finished ) {
+        return false;
+    }
+    size_t separatorPos = separator.empty() ? StringRef::npos : str.find( separator, pos );
+    if( separatorPos == StringRef::npos ) {
+        piece = str.substr( pos );
+        finished = true;
+        return true;
+    }
+    piece = str.substr( pos, separatorPos - pos );
+    pos = separatorPos + separator.length;
+    return true;
+}
+
 vector<string> split(const string &str, const string &separator ) {
 	vector<string> splitstring;
-	int start = 0;
-	int npos = (int)str.find(separator);
-	while (npos != (int)str.npos ) {
-		splitstring.push_back( str.substr(start, npos-start) );
-		start = npos + (int)separator.length();
-		npos = (int)str.find(separator, start);
+	SplitIterator pieces( str, separator );
+	StringRef piece;
+	while( pieces.next( piece ) ) {
+		splitstring.push_back( piece.str() );
 	}
-	splitstring.push_back( str.substr( start ) );
     return splitstring;
 }
 
-string trim( const string &target ) {
+namespace {
+    bool isTrimmed( char c ) {
+        return c == ' ' || c == '\r' || c == '\n';
+    }
+}
 
-   int origlen = (int)target.size();
-   int startpos = -1;
-   for( int i = 0; i < origlen; i++ ) {
-      if( target[i] != ' ' && target[i] != '\r' && target[i] != '\n' ) {
-         startpos = i;
-         break;
-      }
+StringRef trimRef( StringRef target ) {
+   size_t start = 0;
+   size_t end = target.length;
+   while( start < end && isTrimmed( target[start] ) ) {
+      start++;
    }
-   int endpos = -1;
-   for( int i = origlen - 1; i >= 0; i-- ) {
-      if( target[i] != ' ' && target[i] != '\r' && target[i] != '\n' ) {
-         endpos = i;
-         break;
-      }      
+   while( end > start && isTrimmed( target[end - 1] ) ) {
+      end--;
    }
-   if( startpos == -1 || endpos == -1 ) {
-      return "";
-   }
-   return target.substr(startpos, endpos-startpos + 1 );
+   return target.substr( start, end - start );
 }
 
-string replace( string targetString, string oldValue, string newValue ) {
+string trim( const string &target ) {
+   return trimRef( target ).str();
+}
+
+string replace( const string &targetString, const string &oldValue, const string &newValue ) {
     size_t pos = targetString.find( oldValue );
     if( pos == string::npos ) {
         return targetString;
     }
-    return targetString.replace( pos, oldValue.length(), newValue );
+    string result = targetString;
+    return result.replace( pos, oldValue.length(), newValue );
 }
-string replaceGlobal( string targetString, string oldValue, string newValue ) {
-    int pos = 0;
+string replaceGlobal( const string &targetString, const string &oldValue, const string &newValue ) {
     string resultString = "";
+    replaceGlobalAppend( resultString, targetString, oldValue, newValue );
+    return resultString;
+}
+void replaceGlobalAppend( std::string &result, StringRef targetString, StringRef oldValue, StringRef newValue ) {
+    if( oldValue.empty() ) {
+        result.append( targetString.data, targetString.length );
+        return;
+    }
+    size_t pos = 0;
     size_t targetPos = targetString.find( oldValue, pos );
-    while( targetPos != string::npos ) {
-        string preOld = targetString.substr( pos, targetPos - pos );
-        resultString += preOld + newValue;
-        pos = targetPos + oldValue.length();
+    while( targetPos != StringRef::npos ) {
+        result.append( targetString.data + pos, targetPos - pos );
+        result.append( newValue.data, newValue.length );
+        pos = targetPos + oldValue.length;
         targetPos = targetString.find( oldValue, pos );
     }
-    resultString += targetString.substr(pos);
-    return resultString;
+    result.append( targetString.data + pos, targetString.length - pos );
+}
+void replaceGlobalInPlace( std::string &targetString, StringRef oldValue, StringRef newValue ) {
+    if( oldValue.empty() ) {
+        return;
+    }
+    if( newValue.length > oldValue.length ) {
+        // grows, so cant be done in a single pass over targetString itself
+        std::string result;
+        result.reserve( targetString.size() );
+        replaceGlobalAppend( result, targetString, oldValue, newValue );
+        targetString.swap( result );
+        return;
+    }
+    // read and write positions; the write position never overtakes the read one
+    StringRef source( targetString );
+    char *data = &targetString[0];
+    size_t readPos = 0;
+    size_t writePos = 0;
+    size_t targetPos = source.find( oldValue, readPos );
+    while( targetPos != StringRef::npos ) {
+        memmove( data + writePos, data + readPos, targetPos - readPos );
+        writePos += targetPos - readPos;
+        memcpy( data + writePos, newValue.data, newValue.length );
+        writePos += newValue.length;
+        readPos = targetPos + oldValue.length;
+        targetPos = source.find( oldValue, readPos );
+    }
+    memmove( data + writePos, data + readPos, targetString.size() - readPos );
+    writePos += targetString.size() - readPos;
+    targetString.resize( writePos );
+}
+
+namespace {
+    const uint64_t hashPrime1 = 11400714785074694791ULL;
+    const uint64_t hashPrime2 = 14029467366897019727ULL;
+    const uint64_t hashPrime3 = 1609587929392839161ULL;
+    const uint64_t hashPrime4 = 9650029242287828579ULL;
+    const uint64_t hashPrime5 = 2870177450012600261ULL;
+
+    inline uint64_t rotateLeft( uint64_t value, int bits ) {
+        return ( value << bits ) | ( value >> ( 64 - bits ) );
+    }
+    inline uint64_t readWord( const char *data ) {
+        uint64_t word;
+        std::memcpy( &word, data, sizeof( word ) );
+        return word;
+    }
+    inline uint64_t hashRound( uint64_t lane, uint64_t word ) {
+        return rotateLeft( lane + word * hashPrime2, 31 ) * hashPrime1;
+    }
+    inline uint64_t mergeLane( uint64_t hash, uint64_t lane ) {
+        return ( hash ^ hashRound( 0, lane ) ) * hashPrime1 + hashPrime4;
+    }
+}
+
+// four independent lanes, so the multiplies overlap, then the leftover words
+// and bytes, then a final mix so every bit of input affects every bit of
+// the hash
+uint64_t hashString( StringRef text ) {
+    const char *data = text.data;
+    const char *end = data + text.length;
+    uint64_t hash;
+    if( text.length >= 32 ) {
+        uint64_t lane1 = hashPrime1 + hashPrime2;
+        uint64_t lane2 = hashPrime2;
+        uint64_t lane3 = 0;
+        uint64_t lane4 = 0 - hashPrime1;
+        for( ; data + 32 <= end; data += 32 ) {
+            lane1 = hashRound( lane1, readWord( data ) );
+            lane2 = hashRound( lane2, readWord( data + 8 ) );
+            lane3 = hashRound( lane3, readWord( data + 16 ) );
+            lane4 = hashRound( lane4, readWord( data + 24 ) );
+        }
+        hash = rotateLeft( lane1, 1 ) + rotateLeft( lane2, 7 ) + rotateLeft( lane3, 12 ) + rotateLeft( lane4, 18 );
+        hash = mergeLane( hash, lane1 );
+        hash = mergeLane( hash, lane2 );
+        hash = mergeLane( hash, lane3 );
+        hash = mergeLane( hash, lane4 );
+    } else {
+        hash = hashPrime5;
+    }
+    hash += (uint64_t)text.length;
+    for( ; data + 8 <= end; data += 8 ) {
+        hash ^= hashRound( 0, readWord( data ) );
+        hash = rotateLeft( hash, 27 ) * hashPrime1 + hashPrime4;
+    }
+    for( ; data < end; data++ ) {
+        hash ^= (uint8_t)*data * hashPrime5;
+        hash = rotateLeft( hash, 11 ) * hashPrime1;
+    }
+    hash ^= hash >> 33;
+    hash *= hashPrime2;
+    hash ^= hash >> 29;
+    hash *= hashPrime3;
+    hash ^= hash >> 32;
+    return hash;
 }
 
 std::string toLower(std::string in ) {
-     int len = static_cast<int>( in.size() );
+     size_t len = in.size();
      char *buffer = new char[len + 1];
-     for( int i = 0; i < len; i++ ) {
+     for( size_t i = 0; i < len; i++ ) {
         char thischar = in[i];
         thischar = tolower(thischar);
         buffer[i] = thischar;
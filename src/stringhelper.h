@@ -11,6 +11,8 @@
 #include <sstream>
 #include <iostream>
 #include <cstdlib>
+#include <cstring>
+#include <stdint.h>
 
 // #include "ClConvolveDllExport.h"
 
@@ -32,8 +34,64 @@ std::string toString(T val ) { // not terribly efficient, but works...
    return myostringstream.str();
 }
 
+// a piece of a string owned by someone else: just a pointer and a length,
+// so it never allocates.  The owner must outlive it, and not modify it
+class StringRef {
+public:
+    const char *data;
+    size_t length;
+
+    StringRef() : data( "" ), length( 0 ) {}
+    StringRef( const char *data, size_t length ) : data( data ), length( length ) {}
+    StringRef( const char *data ) : data( data ), length( std::strlen( data ) ) {}
+    StringRef( const std::string &str ) : data( str.data() ), length( str.size() ) {}
+
+    static const size_t npos = (size_t)-1;
+
+    size_t size() const { return length; }
+    bool empty() const { return length == 0; }
+    char operator[]( size_t i ) const { return data[i]; }
+    std::string str() const { return std::string( data, length ); }
+    StringRef substr( size_t pos, size_t count = npos ) const {
+        if( pos > length ) {
+            pos = length;
+        }
+        return StringRef( data + pos, count < length - pos ? count : length - pos );
+    }
+    // position of the first occurrence of value, at or after from, or npos
+    size_t find( StringRef value, size_t from = 0 ) const;
+    bool operator==( StringRef other ) const {
+        return length == other.length && std::memcmp( data, other.data, length ) == 0;
+    }
+    bool operator!=( StringRef other ) const {
+        return !( *this == other );
+    }
+};
+
+// split, one piece at a time, without allocating:
+//
+//     SplitIterator pieces( str, " " );
+//     StringRef piece;
+//     while( pieces.next( piece ) ) {
+//         ...
+//     }
+//
+// gives the same pieces as split() would, including empty ones
+class SplitIterator {
+public:
+    SplitIterator( StringRef str, StringRef separator = " " );
+    bool next( StringRef &piece );
+private:
+    StringRef str;
+    StringRef separator;
+    size_t pos;
+    bool finished;
+};
+
 std::vector<std::string> split(const std::string &str, const std::string &separator = " " );
 std::string trim( const std::string &target );
+// like trim, but returns a piece of target, rather than a copy
+StringRef trimRef( StringRef target );
 
 inline float atof( std::string stringvalue ) {
    return (float)std::atof(stringvalue.c_str());
@@ -52,8 +110,19 @@ inline std::string getToken( std::string targetstring, int tokenIndexFromZero, s
    }
 }
 
-std::string replace( std::string targetString, std::string oldValue, std::string newValue );
-std::string replaceGlobal( std::string targetString, std::string oldValue, std::string newValue );
+std::string replace( const std::string &targetString, const std::string &oldValue, const std::string &newValue );
+std::string replaceGlobal( const std::string &targetString, const std::string &oldValue, const std::string &newValue );
+// appends targetString to result, with every oldValue replaced by newValue.
+// result is reused, so once it has grown big enough, this doesnt allocate
+void replaceGlobalAppend( std::string &result, StringRef targetString, StringRef oldValue, StringRef newValue );
+// replaces every oldValue in targetString with newValue; doesnt allocate
+// when newValue is no longer than oldValue
+void replaceGlobalInPlace( std::string &targetString, StringRef oldValue, StringRef newValue );
+
+// a fast 64-bit hash of text, for hash tables, eg of whole templates: reads 32
+// bytes at a time, along the lines of xxHash64.  Not stable across versions,
+// so shouldnt be written into files
+uint64_t hashString( StringRef text );
 
 std::string toLower(std::string in );
 
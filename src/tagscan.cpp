@@ -0,0 +1,163 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// the vector versions compare a block of chars, and the same block shifted
+// by one, and by two, at once: a tag starts wherever the first is '{' and the
+// second is '{' or '%', unless the second and third could start a tag
+// themselves.  The last char of the source cant start a tag, so a block at i
+// is only loaded while i + blockSize + 1 < length, and the tail is left to
+// the portable version
+
+#include <cstring>
+
+#include "tagscan.h"
+
+#ifdef JINJA2CPPLIGHT_TAGSCAN_X86
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define TAGSCAN_TARGET_AVX2 __attribute__((target("avx2")))
+#define TAGSCAN_TARGET_SSE2 __attribute__((target("sse2")))
+#else
+#define TAGSCAN_TARGET_AVX2
+#define TAGSCAN_TARGET_SSE2
+#endif
+
+namespace {
+
+// data[pos] is '{'
+inline bool isTagStart( const char *data, size_t length, size_t pos ) {
+    if( pos + 1 >= length ) {
+        return false;
+    }
+    if( data[pos + 1] == '%' ) {
+        return true;
+    }
+    return data[pos + 1] == '{' && !( pos + 2 < length && ( data[pos + 2] == '{' || data[pos + 2] == '%' ) );
+}
+
+inline unsigned lowestBit( unsigned mask ) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward( &index, mask );
+    return index;
+#else
+    return __builtin_ctz( mask );
+#endif
+}
+
+typedef size_t (*FindTagStartFunction)( const char *data, size_t length, size_t from );
+
+FindTagStartFunction chooseFindTagStart() {
+#ifdef JINJA2CPPLIGHT_TAGSCAN_X86
+    if( tagScanHasAvx2() ) {
+        return findTagStartAvx2;
+    }
+    return findTagStartSse2;
+#else
+    return findTagStartPortable;
+#endif
+}
+
+}
+
+size_t findTagStart( const char *data, size_t length, size_t from ) {
+    static const FindTagStartFunction function = chooseFindTagStart();
+    return function( data, length, from );
+}
+
+size_t findTagStartPortable( const char *data, size_t length, size_t from ) {
+    while( from + 1 < length ) {
+        const char *brace = (const char *)memchr( data + from, '{', length - from - 1 );
+        if( brace == 0 ) {
+            break;
+        }
+        from = brace - data;
+        if( isTagStart( data, length, from ) ) {
+            return from;
+        }
+        from++;
+    }
+    return length;
+}
+
+#ifdef JINJA2CPPLIGHT_TAGSCAN_X86
+
+TAGSCAN_TARGET_SSE2 size_t findTagStartSse2( const char *data, size_t length, size_t from ) {
+    const __m128i brace = _mm_set1_epi8( '{' );
+    const __m128i percent = _mm_set1_epi8( '%' );
+    while( from + 17 < length ) {
+        const __m128i first = _mm_loadu_si128( (const __m128i *)( data + from ) );
+        const __m128i second = _mm_loadu_si128( (const __m128i *)( data + from + 1 ) );
+        const __m128i third = _mm_loadu_si128( (const __m128i *)( data + from + 2 ) );
+        const __m128i secondBrace = _mm_cmpeq_epi8( second, brace );
+        const __m128i secondOpens = _mm_and_si128( secondBrace,
+            _mm_or_si128( _mm_cmpeq_epi8( third, brace ), _mm_cmpeq_epi8( third, percent ) ) );
+        const __m128i opens = _mm_and_si128( _mm_cmpeq_epi8( first, brace ),
+            _mm_andnot_si128( secondOpens, _mm_or_si128( secondBrace, _mm_cmpeq_epi8( second, percent ) ) ) );
+        const unsigned mask = (unsigned)_mm_movemask_epi8( opens );
+        if( mask != 0 ) {
+            return from + lowestBit( mask );
+        }
+        from += 16;
+    }
+    return findTagStartPortable( data, length, from );
+}
+
+TAGSCAN_TARGET_AVX2 size_t findTagStartAvx2( const char *data, size_t length, size_t from ) {
+    const __m256i brace = _mm256_set1_epi8( '{' );
+    const __m256i percent = _mm256_set1_epi8( '%' );
+    while( from + 33 < length ) {
+        const __m256i first = _mm256_loadu_si256( (const __m256i *)( data + from ) );
+        const __m256i second = _mm256_loadu_si256( (const __m256i *)( data + from + 1 ) );
+        const __m256i third = _mm256_loadu_si256( (const __m256i *)( data + from + 2 ) );
+        const __m256i secondBrace = _mm256_cmpeq_epi8( second, brace );
+        const __m256i secondOpens = _mm256_and_si256( secondBrace,
+            _mm256_or_si256( _mm256_cmpeq_epi8( third, brace ), _mm256_cmpeq_epi8( third, percent ) ) );
+        const __m256i opens = _mm256_and_si256( _mm256_cmpeq_epi8( first, brace ),
+            _mm256_andnot_si256( secondOpens, _mm256_or_si256( secondBrace, _mm256_cmpeq_epi8( second, percent ) ) ) );
+        const unsigned mask = (unsigned)_mm256_movemask_epi8( opens );
+        if( mask != 0 ) {
+            return from + lowestBit( mask );
+        }
+        from += 32;
+    }
+    return findTagStartSse2( data, length, from );
+}
+
+bool tagScanHasAvx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid( info, 0 );
+    if( info[0] < 7 ) {
+        return false;
+    }
+    __cpuid( info, 1 );
+    const bool osxsave = ( info[2] & ( 1 << 27 ) ) != 0;
+    const bool avx = ( info[2] & ( 1 << 28 ) ) != 0;
+    if( !osxsave || !avx || ( _xgetbv( 0 ) & 6 ) != 6 ) {
+        return false;
+    }
+    __cpuidex( info, 7, 0 );
+    return ( info[1] & ( 1 << 5 ) ) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "avx2" ) != 0;
+#endif
+}
+
+#else
+
+bool tagScanHasAvx2() {
+    return false;
+}
+
+#endif
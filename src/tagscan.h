@@ -0,0 +1,37 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// finds where the next {{ or {% tag starts, in a block of template source.
+// In a run of braces, the tag starts at the last brace that can start one,
+// so the braces before it are literal text, eg {{% is a { then a {% tag, and
+// {{{x}} is a { then a {{x}} substitution, as in C array initializers.
+// Templates are mostly long runs of literal text, eg OpenCL kernels, with few
+// tags, so this is where parsing spends most of its time.  findTagStart uses
+// the widest vector instructions the cpu supports, chosen at runtime; the
+// individual implementations are exposed too, for tests and benchmarks
+
+#pragma once
+
+#include <cstddef>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define JINJA2CPPLIGHT_TAGSCAN_X86
+#endif
+
+// returns the position of the first {{ or {% at or after from, not followed
+// by { or %, or length if there is none
+size_t findTagStart( const char *data, size_t length, size_t from );
+
+size_t findTagStartPortable( const char *data, size_t length, size_t from );
+
+#ifdef JINJA2CPPLIGHT_TAGSCAN_X86
+// these need the cpu to support sse2, respectively avx2 (see tagScanHasAvx2)
+size_t findTagStartSse2( const char *data, size_t length, size_t from );
+size_t findTagStartAvx2( const char *data, size_t length, size_t from );
+#endif
+
+// true if the cpu, and os, support avx2
+bool tagScanHasAvx2();
@@ -0,0 +1,182 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// templates are parsed without holding the shard's lock, so a slow parse
+// doesnt hold up lookups of other templates.  If two threads miss on the same
+// source at once, both parse it, and whichever inserts second gets, and
+// returns, the first one's, so everyone ends up sharing one compiled template
+
+#include <list>
+#include <unordered_map>
+
+#include "stringhelper.h"
+
+#include "templatecache.h"
+
+namespace Jinja2CppLight {
+
+#undef VIRTUAL
+#define VIRTUAL
+#undef STATIC
+#define STATIC
+
+// templates whose sources hash to the same shard, most recently used first,
+// and indexed by hash.  Padded, so that neighbouring shards' locks dont
+// share a cache line
+class TemplateCache::Shard {
+public:
+    class Entry {
+    public:
+        uint64_t hash;
+        std::shared_ptr< const CompiledTemplate > compiled;
+    };
+    typedef std::unordered_multimap< uint64_t, std::list< Entry >::iterator >::iterator HashIterator;
+
+    mutable std::mutex mutex; // so the stats can be read through a const TemplateCache
+    std::list< Entry > entries; // most recently used first
+    std::unordered_multimap< uint64_t, std::list< Entry >::iterator > byHash;
+    size_t bytes; // of source, in entries
+    char padding[64];
+
+    Shard() : bytes( 0 ) {}
+
+    // the entry whose source matches sourceCode, moved to the front, or null.
+    // Compares the whole source, so templates whose hashes collide are kept
+    // apart
+    std::shared_ptr< const CompiledTemplate > find( uint64_t hash, StringRef sourceCode ) {
+        std::lock_guard< std::mutex > lock( mutex );
+        std::pair< HashIterator, HashIterator > matches = byHash.equal_range( hash );
+        for( HashIterator it = matches.first; it != matches.second; it++ ) {
+            if( it->second->compiled->sourceCode == sourceCode ) {
+                entries.splice( entries.begin(), entries, it->second );
+                return it->second->compiled;
+            }
+        }
+        return std::shared_ptr< const CompiledTemplate >();
+    }
+    // adds compiled, unless another thread added the same source meanwhile,
+    // in which case returns theirs.  Then drops the least recently used
+    // entries while the shard holds more than maxBytes, though never the
+    // newest, even if it is bigger than that on its own, adding the number
+    // dropped to evictionCount
+    std::shared_ptr< const CompiledTemplate > insert( uint64_t hash, std::shared_ptr< const CompiledTemplate > compiled,
+            size_t maxBytes, std::atomic< long long > &evictionCount ) {
+        std::lock_guard< std::mutex > lock( mutex );
+        std::pair< HashIterator, HashIterator > matches = byHash.equal_range( hash );
+        for( HashIterator it = matches.first; it != matches.second; it++ ) {
+            if( it->second->compiled->sourceCode == compiled->sourceCode ) {
+                entries.splice( entries.begin(), entries, it->second );
+                return it->second->compiled;
+            }
+        }
+        Entry entry;
+        entry.hash = hash;
+        entry.compiled = compiled;
+        entries.push_front( entry );
+        byHash.insert( std::make_pair( hash, entries.begin() ) );
+        bytes += compiled->sourceCode.length;
+        while( bytes > maxBytes && entries.size() > 1 ) {
+            std::list< Entry >::iterator oldest = --entries.end();
+            matches = byHash.equal_range( oldest->hash );
+            for( HashIterator it = matches.first; it != matches.second; it++ ) {
+                if( it->second == oldest ) {
+                    byHash.erase( it );
+                    break;
+                }
+            }
+            bytes -= oldest->compiled->sourceCode.length;
+            entries.erase( oldest );
+            evictionCount++;
+        }
+        return compiled;
+    }
+    void clear() {
+        std::lock_guard< std::mutex > lock( mutex );
+        entries.clear();
+        byHash.clear();
+        bytes = 0;
+    }
+};
+
+// one cache for the whole process, with the default limits
+STATIC TemplateCache &TemplateCache::global() {
+    static TemplateCache cache;
+    return cache;
+}
+
+// maxBytes is of template source; the compiled trees are roughly proportional
+TemplateCache::TemplateCache( size_t maxBytes, int numShards ) :
+    maxBytesPerShard( maxBytes / ( numShards > 0 ? numShards : 1 ) ),
+    numShards( numShards > 0 ? numShards : 1 ),
+    shards( new Shard[numShards > 0 ? numShards : 1] ),
+    hitCount( 0 ),
+    missCount( 0 ),
+    evictionCount( 0 ) {
+}
+TemplateCache::~TemplateCache() {
+}
+// returns the compiled form of sourceCode, compiling, and caching, it if it
+// isnt cached already.  Throws render_error, and caches nothing, if
+// sourceCode is malformed
+std::shared_ptr< const CompiledTemplate > TemplateCache::get( StringRef sourceCode ) {
+    const uint64_t hash = hashString( sourceCode );
+    Shard &shard = shards[( hash >> 32 ) % numShards];
+    std::shared_ptr< const CompiledTemplate > compiled = shard.find( hash, sourceCode );
+    if( compiled ) {
+        hitCount++;
+        return compiled;
+    }
+    missCount++;
+    return shard.insert( hash, std::make_shared< CompiledTemplate >( sourceCode.str() ), maxBytesPerShard, evictionCount );
+}
+// as get( sourceCode ), but a template compiled on a miss points into source,
+// rather than copying it
+std::shared_ptr< const CompiledTemplate > TemplateCache::get( std::shared_ptr< const TemplateSource > source ) {
+    const uint64_t hash = hashString( source->text() );
+    Shard &shard = shards[( hash >> 32 ) % numShards];
+    std::shared_ptr< const CompiledTemplate > compiled = shard.find( hash, source->text() );
+    if( compiled ) {
+        hitCount++;
+        return compiled;
+    }
+    missCount++;
+    return shard.insert( hash, std::make_shared< CompiledTemplate >( source ), maxBytesPerShard, evictionCount );
+}
+long long TemplateCache::hits() const {
+    return hitCount.load();
+}
+long long TemplateCache::misses() const {
+    return missCount.load();
+}
+long long TemplateCache::evictions() const {
+    return evictionCount.load();
+}
+// number of templates cached
+size_t TemplateCache::size() const {
+    size_t total = 0;
+    for( size_t i = 0; i < numShards; i++ ) {
+        std::lock_guard< std::mutex > lock( shards[i].mutex );
+        total += shards[i].entries.size();
+    }
+    return total;
+}
+// total source size of the templates cached
+size_t TemplateCache::bytes() const {
+    size_t total = 0;
+    for( size_t i = 0; i < numShards; i++ ) {
+        std::lock_guard< std::mutex > lock( shards[i].mutex );
+        total += shards[i].bytes;
+    }
+    return total;
+}
+// drops every template; any still in use stay alive until they are released
+void TemplateCache::clear() {
+    for( size_t i = 0; i < numShards; i++ ) {
+        shards[i].clear();
+    }
+}
+
+}
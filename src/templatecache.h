@@ -0,0 +1,72 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// compiled templates, by their source, so that constructing the same template
+// again costs a hash of the source, and a lookup, rather than a parse.  Safe
+// to use from any number of threads: the entries are split into shards, by
+// hash, each with its own lock, so threads looking up different templates
+// rarely wait for each other.  Each shard drops its least recently used
+// templates once it holds more than its share of maxBytes of source
+
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+
+#include "Jinja2CppLight.h"
+
+namespace Jinja2CppLight {
+
+class TemplateCache {
+public:
+    static const size_t defaultMaxBytes = 64 * 1024 * 1024;
+    static const int defaultNumShards = 16;
+
+    // [[[cog
+    // import cog_addheaders
+    // cog_addheaders.add(classname='TemplateCache')
+    // ]]]
+    // generated, using cog:
+    STATIC TemplateCache &global();
+    TemplateCache( size_t maxBytes, int numShards );
+    ~TemplateCache();
+    std::shared_ptr< const CompiledTemplate > get( StringRef sourceCode );
+    std::shared_ptr< const CompiledTemplate > get( std::shared_ptr< const TemplateSource > source );
+    long long hits() const;
+    long long misses() const;
+    long long evictions() const;
+    size_t size() const;
+    size_t bytes() const;
+    void clear();
+
+    // [[[end]]]
+
+    TemplateCache() :
+        TemplateCache( defaultMaxBytes, defaultNumShards ) {
+    }
+    TemplateCache( size_t maxBytes ) :
+        TemplateCache( maxBytes, defaultNumShards ) {
+    }
+
+private:
+    class Shard; // see templatecache.cpp
+
+    size_t maxBytesPerShard;
+    size_t numShards;
+    std::unique_ptr< Shard[] > shards;
+    std::atomic< long long > hitCount;
+    std::atomic< long long > missCount;
+    std::atomic< long long > evictionCount;
+
+    TemplateCache( const TemplateCache & ) = delete;
+    TemplateCache &operator=( const TemplateCache & ) = delete;
+};
+
+}
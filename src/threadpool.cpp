@@ -0,0 +1,214 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// parallelFor splits the indices evenly between the caller and the workers,
+// up front, and each then runs its own share, with only its own range's
+// mutex to take, which is almost never contended.  A worker that runs out
+// steals half of the biggest share left, so a worker that is slow, or busy
+// with another batch, doesnt hold everyone up.
+//
+// The pool's mutex only guards the list of batches, and the count of workers
+// inside each.  A batch is taken off the list once anyone finds it empty,
+// and the caller returns once it is off the list, and no workers are still
+// inside it; any indices that were in the middle of being stolen belong to
+// one of those workers, so by then every index has run
+
+#include <algorithm>
+
+#include "threadpool.h"
+
+namespace Jinja2CppLight {
+
+#undef VIRTUAL
+#define VIRTUAL
+#undef STATIC
+#define STATIC
+
+// one call to parallelFor; lives on the caller's stack.  Its indices are
+// split into one range per worker, plus one, at 0, for the caller
+class ThreadPool::Batch {
+public:
+    // the indices from begin to end are still to run.  Its owner takes them
+    // from the front, and other workers, once they run out, steal half from
+    // the back.  Padded, so that neighbouring ranges dont share a cache line
+    class Range {
+    public:
+        std::mutex mutex;
+        size_t begin;
+        size_t end;
+        char padding[64];
+    };
+
+    const WorkerTask *task;
+    std::vector< Range > ranges;
+    int activeWorkers; // workers in work(), not counting the caller; guarded by the pool's mutex
+    std::mutex errorMutex;
+    std::exception_ptr error;
+    size_t errorIndex;
+
+    Batch( size_t numRanges ) : ranges( numRanges ) {}
+
+    // runs indices, until there are none left to take, or steal
+    void work( int worker ) {
+        Range &own = ranges[worker];
+        size_t index;
+        while( takeFront( own, index ) || steal( worker, index ) ) {
+            try {
+                ( *task )( index, worker );
+            } catch( ... ) {
+                std::lock_guard< std::mutex > lock( errorMutex );
+                if( index < errorIndex ) {
+                    error = std::current_exception();
+                    errorIndex = index;
+                }
+            }
+        }
+    }
+    bool takeFront( Range &range, size_t &index ) {
+        std::lock_guard< std::mutex > lock( range.mutex );
+        if( range.begin == range.end ) {
+            return false;
+        }
+        index = range.begin++;
+        return true;
+    }
+    // takes the back half of the biggest range left, runs the first of those
+    // indices next, and keeps the rest in worker's own range, which is empty
+    bool steal( int worker, size_t &index ) {
+        while( true ) {
+            int victim = -1;
+            size_t biggest = 0;
+            for( size_t i = 0; i < ranges.size(); i++ ) {
+                Range &range = ranges[i];
+                std::lock_guard< std::mutex > lock( range.mutex );
+                if( range.end - range.begin > biggest ) {
+                    biggest = range.end - range.begin;
+                    victim = (int)i;
+                }
+            }
+            if( victim < 0 ) {
+                return false;
+            }
+            size_t begin;
+            size_t end;
+            {
+                Range &range = ranges[victim];
+                std::lock_guard< std::mutex > lock( range.mutex );
+                if( range.begin == range.end ) {
+                    continue; // emptied since we looked
+                }
+                end = range.end;
+                begin = range.end - ( range.end - range.begin + 1 ) / 2;
+                range.end = begin;
+            }
+            Range &own = ranges[worker];
+            std::lock_guard< std::mutex > lock( own.mutex );
+            own.begin = begin + 1;
+            own.end = end;
+            index = begin;
+            return true;
+        }
+    }
+    // called with the pool's mutex held
+    void removeFrom( std::deque< Batch * > &batches ) {
+        std::deque< Batch * >::iterator it = std::find( batches.begin(), batches.end(), this );
+        if( it != batches.end() ) {
+            batches.erase( it );
+        }
+    }
+};
+
+// one per core, besides the calling thread
+STATIC int ThreadPool::defaultThreadCount() {
+    const int cores = (int)std::thread::hardware_concurrency();
+    return cores > 1 ? cores - 1 : 0;
+}
+
+// each worker waits for a batch, works on it alongside the caller, and
+// waits again, until the pool is destroyed
+ThreadPool::ThreadPool( int numThreads ) :
+    stopping( false ) {
+    for( int i = 0; i < numThreads; i++ ) {
+        const int worker = i + 1;
+        threads.push_back( std::thread( [this, worker]() {
+            std::unique_lock< std::mutex > lock( mutex );
+            while( true ) {
+                while( batches.empty() && !stopping ) {
+                    workAvailable.wait( lock );
+                }
+                if( stopping ) {
+                    return;
+                }
+                Batch *batch = batches.front();
+                batch->activeWorkers++;
+                lock.unlock();
+                batch->work( worker );
+                lock.lock();
+                batch->removeFrom( batches );
+                batch->activeWorkers--;
+                if( batch->activeWorkers == 0 ) {
+                    workerFinished.notify_all();
+                }
+            }
+        } ) );
+    }
+}
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard< std::mutex > lock( mutex );
+        stopping = true;
+    }
+    workAvailable.notify_all();
+    for( size_t i = 0; i < threads.size(); i++ ) {
+        threads[i].join();
+    }
+}
+// number of worker threads, not counting the threads calling parallelFor
+int ThreadPool::size() const {
+    return (int)threads.size();
+}
+// calls task( i ) for each i from 0 to count - 1, spread over the workers and
+// the calling thread, and returns once they have all returned.  If any throw,
+// rethrows the exception from the lowest i, after the rest have finished
+void ThreadPool::parallelFor( size_t count, const Task &task ) {
+    parallelForWorker( count, [&task]( size_t index, int worker ) {
+        task( index );
+    } );
+}
+// like parallelFor, but also tells task which thread is running it: 0 for
+// the calling thread, and 1 to size() for the workers.  No two tasks of one
+// call run on the same worker at once, so eg each worker can have its own
+// scratch space
+void ThreadPool::parallelForWorker( size_t count, const WorkerTask &task ) {
+    if( count == 0 ) {
+        return;
+    }
+    const size_t numRanges = count > 1 ? threads.size() + 1 : 1;
+    Batch batch( numRanges );
+    batch.task = &task;
+    batch.activeWorkers = 0;
+    batch.errorIndex = count;
+    for( size_t i = 0; i < numRanges; i++ ) {
+        batch.ranges[i].begin = count * i / numRanges;
+        batch.ranges[i].end = count * ( i + 1 ) / numRanges;
+    }
+    if( numRanges > 1 ) {
+        std::lock_guard< std::mutex > lock( mutex );
+        batches.push_back( &batch );
+        workAvailable.notify_all();
+    }
+    batch.work( 0 );
+    std::unique_lock< std::mutex > lock( mutex );
+    batch.removeFrom( batches );
+    while( batch.activeWorkers > 0 ) {
+        workerFinished.wait( lock );
+    }
+    if( batch.error ) {
+        std::rethrow_exception( batch.error );
+    }
+}
+
+}
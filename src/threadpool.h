@@ -0,0 +1,65 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// a fixed set of worker threads, for rendering parts of a template, or many
+// templates, in parallel.  The thread calling parallelFor works on its own
+// tasks too, rather than just waiting, so parallelFor can be called from
+// inside a task without deadlocking, and a pool with no threads at all just
+// runs everything on the calling thread
+
+#pragma once
+
+#include <cstddef>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+
+namespace Jinja2CppLight {
+
+#define STATIC static
+
+class ThreadPool {
+public:
+    typedef std::function< void( size_t ) > Task; // called with the index
+    typedef std::function< void( size_t, int ) > WorkerTask; // called with the index, and the worker
+
+    // [[[cog
+    // import cog_addheaders
+    // cog_addheaders.add(classname='ThreadPool')
+    // ]]]
+    // generated, using cog:
+    STATIC int defaultThreadCount();
+    ThreadPool( int numThreads );
+    ~ThreadPool();
+    int size() const;
+    void parallelFor( size_t count, const Task &task );
+    void parallelForWorker( size_t count, const WorkerTask &task );
+
+    // [[[end]]]
+
+    ThreadPool() :
+        ThreadPool( defaultThreadCount() ) {
+    }
+
+private:
+    class Batch; // one call to parallelFor, see threadpool.cpp
+
+    std::vector< std::thread > threads;
+    std::deque< Batch * > batches; // that may have indices left to run, oldest first
+    std::mutex mutex;
+    std::condition_variable workAvailable;
+    std::condition_variable workerFinished;
+    bool stopping;
+
+    ThreadPool( const ThreadPool & ) = delete;
+    ThreadPool &operator=( const ThreadPool & ) = delete;
+};
+
+}
@@ -0,0 +1,33 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// counts the bytes allocated by every heap allocation in the unit tests, so
+// tests can check that eg compiling a template doesnt copy its source.  See
+// allocatedByteCount() in gtest_supp.h
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+    std::atomic<long long> allocatedBytes( 0 );
+}
+
+long long allocatedByteCount() {
+    return allocatedBytes.load();
+}
+
+void *operator new( size_t size ) {
+    allocatedBytes += size;
+    void *result = malloc( size == 0 ? 1 : size );
+    if( result == 0 ) {
+        throw std::bad_alloc();
+    }
+    return result;
+}
+void operator delete( void *pointer ) noexcept {
+    free( pointer );
+}
@@ -18,4 +18,5 @@ inline ::testing::AssertionResult AssertFloatsNear( const char *expr_one, const
 #define EXPECT_FLOAT_NEAR( one, two) EXPECT_PRED_FORMAT2( AssertFloatsNear, one, two )
 #define ASSERT_FLOAT_NEAR( one, two) ASSERT_PRED_FORMAT2( AssertFloatsNear, one, two )
 
-
+// bytes allocated on the heap so far, by any thread; see allocationcount.cpp
+long long allocatedByteCount();
@@ -0,0 +1,144 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// renders shared compiled templates from many threads at once, checking each
+// output against the same render done on one thread.  Built, with
+// ThreadSanitizer, as jinja2cpplight_stress, when cmake is run with
+// -DJINJA2CPPLIGHT_STRESS=ON, so that tsan reports any render that touches
+// shared state.  Exits with 1 if any output is wrong
+//
+// usage: jinja2cpplight_stress [threads [rounds]]
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <thread>
+#include <atomic>
+
+#include "Jinja2CppLight.h"
+#include "threadpool.h"
+#include "templatecache.h"
+
+using namespace std;
+using namespace Jinja2CppLight;
+
+namespace {
+    const char *sources[] = {
+        "{% for i in range(its) %}out[{{i}}] = in[{{i}}] * {{scale}} + {{bias}};\n{% endfor %}",
+        "{{name}}: {% if enabled %}{% for i in range(its) %}{{name}}{{i}} {% endfor %}{% endif %}"
+            "{% if not enabled %}disabled{% endif %}",
+        "{% for i in range(its) %}{% for j in range(3) %}({{i}},{{j}},{{scale}}){% endfor %}\n{% endfor %}",
+    };
+    const int numSources = sizeof( sources ) / sizeof( sources[0] );
+
+    void setValues( Context &context, int seed ) {
+        context.setValue( "its", 10 + seed % 50 );
+        context.setValue( "scale", 0.25f * seed, seed % 4 );
+        context.setValue( "bias", -seed );
+        context.setValue( "name", "thread" + toString( seed ) );
+        context.setValue( "enabled", seed % 3 );
+    }
+
+    string expectedOutput( int source, int seed ) {
+        CompiledTemplate compiled( sources[source] );
+        Context context( compiled );
+        setValues( context, seed );
+        return context.render();
+    }
+
+    atomic< int > failures( 0 );
+
+    void check( const string &what, const string &expected, const string &actual ) {
+        if( expected != actual ) {
+            if( failures++ == 0 ) {
+                cout << what << ": expected:" << endl << expected << endl << "actual:" << endl << actual << endl;
+            }
+        }
+    }
+
+    void stress( const vector< CompiledTemplate * > &compiled, const vector< Context * > &shared,
+            const vector< vector< string > > &expected, ThreadPool *pool, int index, int rounds ) {
+        const int seed = index % (int)expected[0].size();
+        // each thread with its own context, on shared compiled templates
+        vector< Context > contexts;
+        for( int s = 0; s < numSources; s++ ) {
+            contexts.push_back( Context( *compiled[s] ) );
+            setValues( contexts.back(), seed );
+        }
+        BatchRenderer batchRenderer( 2 );
+        string buffer;
+        for( int round = 0; round < rounds; round++ ) {
+            for( int s = 0; s < numSources; s++ ) {
+                contexts[s].renderInto( buffer );
+                check( "renderInto", expected[s][seed], buffer );
+                // copies of a context shared between the threads
+                Context copy( *shared[s] );
+                check( "copied context", expected[s][0], copy.render() );
+                // and with loops split over a pool shared by all the threads
+                copy.setParallelLoops( pool, 4 );
+                check( "parallel loops", expected[s][0], copy.render() );
+                // parsing, and batches, concurrently too
+                if( round % 16 == 0 ) {
+                    vector< Context > batch( 20, *shared[s] );
+                    vector< string > outputs = batchRenderer.render( batch );
+                    for( size_t i = 0; i < outputs.size(); i++ ) {
+                        check( "batch", expected[s][0], outputs[i] );
+                    }
+                    CompiledTemplate parsed( sources[s] );
+                    Context context( parsed );
+                    setValues( context, seed );
+                    check( "parsed", expected[s][seed], context.render() );
+                }
+                // and the same templates, from a cache shared by all the threads
+                if( round % 4 == 0 ) {
+                    shared_ptr< const CompiledTemplate > cached = TemplateCache::global().get( sources[s] );
+                    Context context( *cached );
+                    setValues( context, seed );
+                    check( "cached", expected[s][seed], context.render() );
+                }
+            }
+        }
+    }
+}
+
+int main( int argc, char *argv[] ) {
+    const int numThreads = argc > 1 ? atoi( argv[1] ) : 8;
+    const int rounds = argc > 2 ? atoi( argv[2] ) : 200;
+    const int numSeeds = 5;
+
+    vector< vector< string > > expected( numSources );
+    vector< CompiledTemplate * > compiled;
+    vector< Context * > shared;
+    for( int s = 0; s < numSources; s++ ) {
+        for( int seed = 0; seed < numSeeds; seed++ ) {
+            expected[s].push_back( expectedOutput( s, seed ) );
+        }
+        compiled.push_back( new CompiledTemplate( sources[s] ) );
+        shared.push_back( new Context( *compiled.back() ) );
+        setValues( *shared.back(), 0 );
+    }
+
+    ThreadPool pool( 3 );
+    vector< thread > threads;
+    for( int i = 0; i < numThreads; i++ ) {
+        threads.push_back( thread( stress, cref( compiled ), cref( shared ), cref( expected ), &pool, i, rounds ) );
+    }
+    for( int i = 0; i < numThreads; i++ ) {
+        threads[i].join();
+    }
+
+    for( int s = 0; s < numSources; s++ ) {
+        delete shared[s];
+        delete compiled[s];
+    }
+    if( failures > 0 ) {
+        cout << failures << " wrong outputs, from " << numThreads << " threads" << endl;
+        return 1;
+    }
+    cout << "ok: " << numThreads << " threads, " << rounds << " rounds" << endl;
+    return 0;
+}
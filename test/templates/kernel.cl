@@ -0,0 +1,5 @@
+kernel void copy( global const float *in, global float *out ) {
+    const int globalId = get_global_id(0);
+    {% for i in range(its) %}out[globalId * {{its}} + {{i}}] = in[globalId * {{its}} + {{i}}];
+    {% endfor %}
+}
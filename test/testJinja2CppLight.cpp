@@ -5,12 +5,17 @@
 // obtain one at http://mozilla.org/MPL/2.0/.
 
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
 #include <string>
+#include <thread>
 
 #include "gtest/gtest.h"
 #include "test/gtest_supp.h"
 
 #include "Jinja2CppLight.h"
+#include "threadpool.h"
 
 using namespace std;
 using namespace Jinja2CppLight;
@@ -191,3 +196,800 @@ TEST(testSpeedTemplates, ifUnexpectedExpression) {
     EXPECT_EQ(true, threw);
 }
 
+
+TEST(testSpeedTemplates, renderTwice) {
+    const std::string source = "abc{% for i in range(its) %}[{{i}}]{% endfor %}{% if its %}def{% endif %}ghi";
+    Template mytemplate(source);
+    mytemplate.setValue("its", 3);
+    EXPECT_EQ(std::string("abc[0][1][2]defghi"), mytemplate.render());
+    EXPECT_EQ(std::string("abc[0][1][2]defghi"), mytemplate.render());
+
+    mytemplate.setValue("its", 0);
+    EXPECT_EQ(std::string("abcghi"), mytemplate.render());
+}
+
+TEST(testSpeedTemplates, compiledTemplate) {
+    CompiledTemplate compiled("{% for i in range(its) %}a[{{i}}] = {{x}};{% endfor %}");
+    std::map<std::string, Value> valueByName;
+    valueByName["its"] = Value(2);
+    valueByName["x"] = Value(std::string("b"));
+    EXPECT_EQ(std::string("a[0] = b;a[1] = b;"), compiled.render(valueByName));
+    valueByName["its"].setInt(1);
+    EXPECT_EQ(std::string("a[0] = b;"), compiled.render(valueByName));
+}
+
+TEST(testSpeedTemplates, compileError) {
+    bool threw = false;
+    try {
+        CompiledTemplate compiled("abc{% for i in range(3) %}def");
+    } catch (const render_error &e) {
+        threw = true;
+    }
+    EXPECT_EQ(true, threw);
+}
+
+TEST(testSpeedTemplates, substitutionSegments) {
+    Template mytemplate("{{a}}-{{ b }}-{{ a | upper }}}}{{c}}");
+    mytemplate.setValue("a", "x");
+    mytemplate.setValue("b", 2);
+    mytemplate.setValue("c", "");
+    EXPECT_EQ(std::string("x-2-x}}"), mytemplate.render());
+}
+
+TEST(testSpeedTemplates, substitutionUnterminated) {
+    Template mytemplate("abc {{ a ");
+    mytemplate.setValue("a", 1);
+    bool threw = false;
+    try {
+        mytemplate.render();
+    } catch (const render_error &e) {
+        EXPECT_EQ(std::string("substitution unterminated: {{ a "), e.what());
+        threw = true;
+    }
+    EXPECT_EQ(true, threw);
+}
+
+TEST(testSpeedTemplates, doSubstitutions) {
+    std::map<std::string, Value> valueByName;
+    valueByName["a"] = Value(3);
+    const std::map<std::string, Value> &constValueByName = valueByName;
+    EXPECT_EQ(std::string("a is 3"), Template::doSubstitutions("a is {{a}}", constValueByName));
+    // only {{ }} is substituted; control tags, even unterminated ones, are just text
+    EXPECT_EQ(std::string("x {% y 3"), Template::doSubstitutions("x {% y {{a}}", constValueByName));
+    EXPECT_EQ(std::string("{% if a %}3{% endif %}"), Template::doSubstitutions("{% if a %}{{ a }}{% endif %}", constValueByName));
+    // braces before a tag are text, as when compiling
+    EXPECT_EQ(std::string("{3}"), Template::doSubstitutions("{{{a}}}", constValueByName));
+    EXPECT_EQ(std::string("{{% if a %}3"), Template::doSubstitutions("{{% if a %}{{a}}", constValueByName));
+}
+
+TEST(testSpeedTemplates, slots) {
+    CompiledTemplate compiled("{{a}}{% for i in range(n) %}{{a}}{{i}}{% endfor %}{% if b %}{{b}}{% endif %}{% if True %}!{% endif %}");
+    EXPECT_EQ(4, compiled.slots.size());
+    EXPECT_EQ(0, compiled.slots.find("a"));
+    EXPECT_EQ(-1, compiled.slots.find("True"));
+    EXPECT_EQ(-1, compiled.slots.find("unused"));
+
+    std::vector<const Value *> valueBySlot(compiled.slots.size(), (const Value *)0);
+    Value n(2);
+    Value a(std::string("x"));
+    valueBySlot[compiled.slots.find("n")] = &n;
+    valueBySlot[compiled.slots.find("a")] = &a;
+    EXPECT_EQ(std::string("xx0x1!"), compiled.render(valueBySlot));
+}
+
+TEST(testSpeedTemplates, setValueAfterCompile) {
+    Template mytemplate("{{a}}{% if b %}{{b}}{% endif %}");
+    mytemplate.setValue("a", 1);
+    EXPECT_EQ(std::string("1"), mytemplate.render());
+    mytemplate.setValue("b", "yes");
+    mytemplate.setValue("a", 2);
+    mytemplate.setValue("unused", 3);
+    EXPECT_EQ(std::string("2yes"), mytemplate.render());
+}
+
+TEST(testSpeedTemplates, loopVariableUnsetAfterError) {
+    Template mytemplate("{% for i in range(2) %}{{i}}{{a}}{% endfor %}");
+    bool threw = false;
+    try {
+        mytemplate.render();
+    } catch (const render_error &e) {
+        EXPECT_EQ(std::string("name a not defined"), e.what());
+        threw = true;
+    }
+    EXPECT_EQ(true, threw);
+    mytemplate.setValue("a", ";");
+    EXPECT_EQ(std::string("0;1;"), mytemplate.render());
+}
+
+TEST(testSpeedTemplates, values) {
+    Value undefined;
+    EXPECT_EQ(Value::Undefined, undefined.getType());
+    EXPECT_EQ(false, undefined.isTrue());
+
+    Value shortString(std::string("short"));
+    Value longString(std::string("a string that is too long to store inline"));
+    EXPECT_EQ(std::string("short"), shortString.render());
+    EXPECT_EQ(std::string("a string that is too long to store inline"), longString.render());
+
+    Value copy(longString);
+    longString = shortString;
+    EXPECT_EQ(std::string("short"), longString.render());
+    EXPECT_EQ(std::string("a string that is too long to store inline"), copy.render());
+    copy.setInt(0);
+    EXPECT_EQ(false, copy.isTrue());
+    EXPECT_EQ(std::string("0"), copy.render());
+    EXPECT_EQ(std::string("1.5"), Value(1.5f).render());
+    EXPECT_EQ(false, Value(std::string("")).isTrue());
+}
+
+TEST(testSpeedTemplates, loopRangeMustBeInt) {
+    Template mytemplate("{% for i in range(its) %}{{i}}{% endfor %}");
+    mytemplate.setValue("its", "3");
+    bool threw = false;
+    try {
+        mytemplate.render();
+    } catch (const render_error &e) {
+        EXPECT_EQ(std::string("for loop range var its must be an int (but it's not)"), e.what());
+        threw = true;
+    }
+    EXPECT_EQ(true, threw);
+}
+
+// a bound too big for an int isnt wrapped round, but taken as a variable
+// name, like any other word that isnt an int
+TEST(testSpeedTemplates, loopRangeOutOfRange) {
+    const char *sources[] = {
+        "{% for i in range(4294967297) %}{{i}}{% endfor %}",
+        "{% for i in range(99999999999) %}{{i}}{% endfor %}",
+        "{% for i in range(-2147483649) %}{{i}}{% endfor %}",
+    };
+    const char *messages[] = {
+        "for loop range var 4294967297 not recognized",
+        "for loop range var 99999999999 not recognized",
+        "for loop range var -2147483649 not recognized",
+    };
+    for(size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        Template mytemplate(sources[i]);
+        try {
+            mytemplate.render();
+            FAIL() << "no exception for " << sources[i];
+        } catch(const render_error &e) {
+            EXPECT_EQ(std::string(messages[i]), e.what());
+        }
+    }
+    // the most negative bound that still fits
+    Template smallest("{% for i in range(-2147483647) %}x{% endfor %}done");
+    EXPECT_EQ(std::string("done"), smallest.render());
+}
+
+namespace {
+    void countChunks(void *userData, const char *data, size_t length) {
+        std::vector<std::string> *chunks = static_cast<std::vector<std::string> *>(userData);
+        chunks->push_back(std::string(data, length));
+    }
+}
+
+TEST(testSpeedTemplates, renderToSink) {
+    Template mytemplate("a{% for i in range(2) %}[{{i}}]{% endfor %}{% if x %}{{x}}{% endif %}");
+    mytemplate.setValue("x", "b");
+
+    std::ostringstream stream;
+    mytemplate.render(stream);
+    EXPECT_EQ(std::string("a[0][1]b"), stream.str());
+
+    std::string target = "existing:";
+    StringSink stringSink(target);
+    mytemplate.render(stringSink);
+    EXPECT_EQ(std::string("existing:a[0][1]b"), target);
+
+    std::vector<std::string> chunks;
+    CallbackSink callbackSink(countChunks, &chunks);
+    mytemplate.render(callbackSink);
+    ASSERT_EQ(8u, chunks.size());
+    EXPECT_EQ(std::string("a"), chunks[0]);
+    EXPECT_EQ(std::string("b"), chunks[7]);
+}
+
+TEST(testSpeedTemplates, renderInto) {
+    Template mytemplate("{% for i in range(its) %}{{x}}{% endfor %}");
+    mytemplate.setValue("its", 100);
+    mytemplate.setValue("x", "abc");
+    std::string buffer = "previous contents";
+    mytemplate.renderInto(buffer);
+    EXPECT_EQ(300u, buffer.size());
+    EXPECT_EQ(300u, mytemplate.context->outputSizeHint);
+
+    const size_t capacity = buffer.capacity();
+    mytemplate.setValue("its", 2);
+    mytemplate.renderInto(buffer);
+    EXPECT_EQ(std::string("abcabc"), buffer);
+    EXPECT_EQ(capacity, buffer.capacity());
+    EXPECT_EQ(300u, mytemplate.context->outputSizeHint);
+
+    std::string fresh;
+    mytemplate.renderInto(fresh);
+    EXPECT_EQ(std::string("abcabc"), fresh);
+    EXPECT_LE(300u, fresh.capacity());
+}
+
+TEST(testSpeedTemplates, context) {
+    const CompiledTemplate compiled("{{name}}: {% for i in range(its) %}{{i}}{% endfor %}");
+    Context context(compiled);
+    context.setValue("name", "first");
+    context.setValue("its", 3);
+    context.setValue("unused", 1.5f);
+    EXPECT_EQ(std::string("first: 012"), context.render());
+
+    Context copy(context);
+    copy.setValue("name", "second");
+    EXPECT_EQ(std::string("second: 012"), copy.render());
+    EXPECT_EQ(std::string("first: 012"), context.render());
+
+    context = copy;
+    copy.setValue("its", 1);
+    EXPECT_EQ(std::string("second: 012"), context.render());
+    EXPECT_EQ(std::string("second: 0"), copy.render());
+}
+
+TEST(testSpeedTemplates, contextsShareCompiledAcrossThreads) {
+    const CompiledTemplate compiled("{% for i in range(its) %}{{prefix}}{{i}} {% endfor %}");
+    const int numThreads = 4;
+    std::vector<std::string> results(numThreads);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < numThreads; t++) {
+        threads.push_back(std::thread([&compiled, &results, t]() {
+            Context context(compiled);
+            context.setValue("prefix", std::string(1, (char)('a' + t)));
+            context.setValue("its", 100 + t);
+            std::string buffer;
+            for(int it = 0; it < 50; it++) {
+                context.renderInto(buffer);
+            }
+            results[t] = buffer;
+        }));
+    }
+    for(int t = 0; t < numThreads; t++) {
+        threads[t].join();
+    }
+    for(int t = 0; t < numThreads; t++) {
+        std::string expected = "";
+        for(int i = 0; i < 100 + t; i++) {
+            expected += std::string(1, (char)('a' + t)) + toString(i) + " ";
+        }
+        EXPECT_EQ(expected, results[t]);
+    }
+}
+
+TEST(testSpeedTemplates, parallelLoops) {
+    const CompiledTemplate compiled(
+        "start {% for i in range(its) %}[{{i}}{% for j in range(3) %} {{j}}{{name}}{% endfor %}"
+        "{% if flag %}!{% endif %}]{% endfor %} end {% for k in range(2) %}{{k}}{% endfor %}");
+    Context serial(compiled);
+    serial.setValue("name", "x");
+    serial.setValue("flag", 1);
+    ThreadPool pool(3);
+    for(int its = 0; its < 40; its += 3) {
+        serial.setValue("its", its);
+        Context parallel(serial);
+        parallel.setParallelLoops(&pool, 2);
+        EXPECT_EQ(serial.render(), parallel.render());
+    }
+}
+
+TEST(testSpeedTemplates, parallelLoopErrors) {
+    const CompiledTemplate compiled("{% for i in range(its) %}{{i}}{% for j in range(inner) %}{% endfor %}{% endfor %}");
+    ThreadPool pool(2);
+    Context context(compiled);
+    context.setValue("its", 100);
+    context.setParallelLoops(&pool, 10);
+    std::string output;
+    StringSink sink(output);
+    try {
+        context.render(sink);
+        FAIL() << "expected render_error";
+    } catch(render_error &e) {
+        EXPECT_EQ(std::string("for loop range var inner not recognized"), std::string(e.what()));
+    }
+    // same as rendering serially: everything up to the error
+    EXPECT_EQ(std::string("0"), output);
+    EXPECT_EQ(0, context.valueBySlot[compiled.slots.find("i")]);
+
+    context.setValue("inner", 1);
+    context.setValue("its", 9);
+    EXPECT_EQ(std::string("012345678"), context.render());
+}
+
+TEST(testSpeedTemplates, batchRender) {
+    const CompiledTemplate compiled("kernel {{name}}: {% for i in range(its) %}{{i}},{% endfor %}");
+    std::vector<Context> contexts;
+    for(int i = 0; i < 200; i++) {
+        contexts.push_back(Context(compiled));
+        contexts.back().setValue("name", "k" + toString(i));
+        contexts.back().setValue("its", i % 17);
+    }
+    BatchRenderer renderer(3);
+    std::vector<std::string> outputs = renderer.render(contexts);
+    ASSERT_EQ(contexts.size(), outputs.size());
+    for(size_t i = 0; i < contexts.size(); i++) {
+        EXPECT_EQ(contexts[i].render(), outputs[i]);
+    }
+
+    // rendering into the same outputs again reuses them
+    contexts.erase(contexts.begin() + 50, contexts.end());
+    contexts[7].setValue("name", "changed");
+    renderer.render(contexts, outputs);
+    ASSERT_EQ(50u, outputs.size());
+    EXPECT_EQ(std::string("kernel changed: 0,1,2,3,4,5,6,"), outputs[7]);
+    EXPECT_EQ(std::string("kernel k49: 0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,"), outputs[49]);
+}
+
+TEST(testSpeedTemplates, batchRenderErrors) {
+    const CompiledTemplate compiled("{{name}}");
+    std::vector<Context> contexts(10, Context(compiled));
+    for(size_t i = 0; i < contexts.size(); i++) {
+        if(i != 3 && i != 8) {
+            contexts[i].setValue("name", toString(i));
+        }
+    }
+    BatchRenderer renderer(2);
+    std::vector<std::string> outputs;
+    EXPECT_THROW(renderer.render(contexts, outputs), render_error);
+    ASSERT_EQ(10u, outputs.size());
+    EXPECT_EQ(std::string("9"), outputs[9]);
+    EXPECT_EQ(std::string(""), outputs[3]);
+}
+
+TEST(testSpeedTemplates, batchRendererThreadCount) {
+    EXPECT_THROW(BatchRenderer renderer(-1), std::invalid_argument);
+
+    // no threads of its own: renders on the calling thread
+    const CompiledTemplate compiled("{{name}}");
+    std::vector<Context> contexts(2, Context(compiled));
+    contexts[0].setValue("name", "one");
+    contexts[1].setValue("name", "two");
+    BatchRenderer renderer(0);
+    std::vector<std::string> outputs = renderer.render(contexts);
+    ASSERT_EQ(2u, outputs.size());
+    EXPECT_EQ(std::string("one"), outputs[0]);
+    EXPECT_EQ(std::string("two"), outputs[1]);
+}
+
+TEST(testSpeedTemplates, floatFormatting) {
+    Template mytemplate("{{a}} {{b}} {{c}} {{d}}");
+    mytemplate.setValue("a", 0.1f);
+    mytemplate.setValue("b", 1234567.0f);
+    mytemplate.setValue("c", 3.14159f, 2);
+    mytemplate.setValue("d", -7);
+    EXPECT_EQ(std::string("0.1 1234567 3.14 -7"), mytemplate.render());
+}
+
+// floats that need more than 6 significant digits to read back exactly are
+// rendered in full, rather than rounded to 6 as ostream does by default
+TEST(testSpeedTemplates, floatsKeepAllSignificantDigits) {
+    Template mytemplate("{{a}} {{b}} {{c}} {{d}}");
+    mytemplate.setValue("a", 1234567.0f);
+    mytemplate.setValue("b", 1.0f / 3);
+    mytemplate.setValue("c", 16777216.0f);
+    mytemplate.setValue("d", 123456.0f);
+    EXPECT_EQ(std::string("1234567 0.33333334 16777216 123456"), mytemplate.render());
+}
+
+TEST(testSpeedTemplates, lexer) {
+    const std::string source = "ab{{ x | upper }}{%for i in range(n)%}c{ d}{% endfor %}";
+    TemplateLexer lexer(source);
+    const Token::Type expected[] = {Token::Text, Token::Variable, Token::BlockBegin, Token::Name, Token::Name,
+        Token::Name, Token::Name, Token::LeftParen, Token::Name, Token::RightParen, Token::BlockEnd,
+        Token::Text, Token::BlockBegin, Token::Name, Token::BlockEnd, Token::End};
+    std::vector<std::string> texts;
+    for(size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        Token token = lexer.next();
+        EXPECT_EQ(expected[i], token.type);
+        texts.push_back(source.substr(token.start, token.length));
+    }
+    EXPECT_EQ(std::string("ab"), texts[0]);
+    EXPECT_EQ(std::string("x"), texts[1]);
+    EXPECT_EQ(std::string("for"), texts[3]);
+    EXPECT_EQ(std::string("n"), texts[8]);
+    EXPECT_EQ(std::string("c{ d}"), texts[11]);
+    EXPECT_EQ(std::string("endfor"), texts[13]);
+}
+
+// a { directly before a tag is literal text, as in C initializers and blocks
+TEST(testSpeedTemplates, braceBeforeTag) {
+    Template loop("float w[] = {{% for i in range(3) %}{{i}},{% endfor %}};");
+    EXPECT_EQ(std::string("float w[] = {0,1,2,};"), loop.render());
+
+    Template ifBlock("if (x) {{% if a %}y = 1;{% endif %}}");
+    ifBlock.setValue("a", 1);
+    EXPECT_EQ(std::string("if (x) {y = 1;}"), ifBlock.render());
+
+    // the substitution is the last {{ of a run of braces
+    Template nested("int v[] = {{{x}}};");
+    nested.setValue("x", 3);
+    EXPECT_EQ(std::string("int v[] = {3};"), nested.render());
+    Template tripleBlock("{{{% if a %}a{% endif %}}}");
+    tripleBlock.setValue("a", 1);
+    EXPECT_EQ(std::string("{{a}}"), tripleBlock.render());
+}
+
+TEST(testSpeedTemplates, parseErrors) {
+    const char *sources[] = {
+        "abc{% for i in range(3) def",
+        "{% for i of range(3) %}{% endfor %}",
+        "{% for i in range 3 %}{% endfor %}",
+        "{% if a %}{% endfor %}",
+        "{% endif %}",
+        "{% while a %}",
+    };
+    const char *messages[] = {
+        "control section unterminated: {% for i in range(3) def",
+        "control section {% for i of range(3) unexpected: second word should be 'in'",
+        "control section for i in range 3 unexpected: should be in format 'range(somevar)' or 'range(somenumber)'",
+        "No control end section found, expected '{% endif %}', got '{% endfor %}'",
+        "some sourcecode found at end: {% endif %}",
+        "control section {% while a unexpected",
+    };
+    for(size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        try {
+            CompiledTemplate compiled(sources[i]);
+            FAIL() << "no exception for " << sources[i];
+        } catch(render_error &e) {
+            EXPECT_EQ(std::string(messages[i]), e.what());
+        }
+    }
+}
+
+namespace {
+    std::string nestedIfs(size_t depth) {
+        std::string source;
+        for(size_t i = 0; i < depth; i++) {
+            source += "{% if True %}";
+        }
+        source += "x";
+        for(size_t i = 0; i < depth; i++) {
+            source += "{% endif %}";
+        }
+        return source;
+    }
+}
+
+TEST(testSpeedTemplates, deeplyNested) {
+    const std::string deepest = nestedIfs(CompiledTemplate::maxNestingDepth);
+    Template mytemplate(deepest);
+    EXPECT_EQ(std::string("x"), mytemplate.render());
+    CompiledTemplate compiled(deepest);
+    std::shared_ptr<const CompiledTemplate> loaded = CompiledTemplate::load(TemplateSource::fromString(compiled.serialize()));
+    EXPECT_EQ(std::string("x"), loaded->render(std::map<std::string, Value>()));
+
+    // one more level is rejected when parsing, rather than overflowing the stack when rendering
+    try {
+        CompiledTemplate tooDeep(nestedIfs(CompiledTemplate::maxNestingDepth + 1));
+        FAIL() << "expected render_error";
+    } catch(render_error &e) {
+        EXPECT_EQ(std::string("control section {% if True nested more than 1000 deep"), e.what());
+    }
+    std::string forLoops;
+    for(size_t i = 0; i <= CompiledTemplate::maxNestingDepth; i++) {
+        forLoops += "{% for i in range(1) %}";
+    }
+    for(size_t i = 0; i <= CompiledTemplate::maxNestingDepth; i++) {
+        forLoops += "{% endfor %}";
+    }
+    try {
+        CompiledTemplate tooDeep(forLoops);
+        FAIL() << "expected render_error";
+    } catch(render_error &e) {
+        EXPECT_EQ(std::string("control section {% for i in range(1) nested more than 1000 deep"), e.what());
+    }
+}
+
+namespace {
+    // a template with a megabyte of literal text, besides the tags
+    std::string largeSource() {
+        return "abc {{ x }}def{{y}}{% if x %}ghi" + std::string(1024 * 1024, '.') + "{% endif %}";
+    }
+}
+
+// the compiled tree points into the source, so compiling allocates a little
+// for the tree, but nothing in proportion to the text
+TEST(testSpeedTemplates, compilingDoesntCopySource) {
+    std::shared_ptr<const TemplateSource> source = TemplateSource::fromString(largeSource());
+    const long long before = allocatedByteCount();
+    CompiledTemplate compiled(source);
+    EXPECT_LT(allocatedByteCount() - before, 64 * 1024);
+
+    std::map<std::string, Value> values;
+    values["y"] = Value(2);
+    EXPECT_THROW(compiled.render(values), render_error);
+    values["x"] = Value(1);
+    EXPECT_EQ("abc 1def2ghi" + std::string(1024 * 1024, '.'), compiled.render(values));
+}
+
+TEST(testSpeedTemplates, mappedFile) {
+    const std::string path = "testJinja2CppLight_mappedFile.tmp";
+    {
+        std::ofstream file(path.c_str(), std::ios::binary);
+        file << "{% for i in range(its) %}[{{i}}]{% endfor %} {{ name }}" << std::string(1024 * 1024, '.');
+    }
+    std::shared_ptr<const TemplateSource> source = TemplateSource::mapFile(path);
+    {
+        // neither mapping the file, nor compiling it, reads it onto the heap
+        const long long before = allocatedByteCount();
+        Template mytemplate(source);
+        mytemplate.compile();
+        EXPECT_LT(allocatedByteCount() - before, 64 * 1024);
+
+        mytemplate.setValue("its", 3);
+        mytemplate.setValue("name", "mapped");
+        EXPECT_EQ("[0][1][2] mapped" + std::string(1024 * 1024, '.'), mytemplate.render());
+    }
+    source.reset();
+    remove(path.c_str());
+
+    {
+        std::ofstream file(path.c_str(), std::ios::binary);
+    }
+    Template empty(TemplateSource::mapFile(path));
+    EXPECT_EQ(std::string(""), empty.render());
+    remove(path.c_str());
+
+    EXPECT_THROW(TemplateSource::mapFile("no/such/template.tmp"), std::runtime_error);
+}
+
+namespace {
+    // renders compiled with each of a few sets of values, which between them
+    // take every branch of the templates below, and joins the outputs
+    std::string renderVariants(const CompiledTemplate &compiled) {
+        std::string outputs;
+        for(int variant = 0; variant < 4; variant++) {
+            std::map<std::string, Value> values;
+            values["x"] = Value(variant);
+            values["y"] = Value("two");
+            values["its"] = Value(variant);
+            values["flag"] = Value(variant % 2);
+            outputs += compiled.render(values) + "\n--\n";
+        }
+        return outputs;
+    }
+}
+
+TEST(testSpeedTemplates, chunkedParse) {
+    const std::string source =
+        "a{b {{ x }}{{y|upper}} {%for i in range(its)%}[{{i}}]{% if not flag %}{x}{% endif %}{% endfor %}"
+        "\n{%  if  x  %}end {{x}}{% endif %}{{% if x %}{{{x}}}{% endif %}}{";
+    CompiledTemplate whole(source);
+    std::map<std::string, Value> values;
+    values["x"] = Value(1);
+    values["y"] = Value("two");
+    values["its"] = Value(3);
+    values["flag"] = Value(0);
+    EXPECT_EQ(std::string("a{b 1two [0]{x}[1]{x}[2]{x}\nend 1{{1}}{"), whole.render(values));
+    const std::string expected = renderVariants(whole);
+    for(size_t chunkSize = 1; chunkSize <= source.size() + 1; chunkSize++) {
+        std::istringstream in(source);
+        CompiledTemplate chunked(in, chunkSize);
+        EXPECT_EQ(expected, renderVariants(chunked)) << "chunkSize " << chunkSize;
+        EXPECT_EQ(source, chunked.sourceCode.str());
+    }
+}
+
+// the whole text is kept, but a stream that knows its size is read into a
+// buffer allocated once, at that size, rather than one that keeps doubling
+TEST(testSpeedTemplates, chunkedParseBuffersOnce) {
+    const std::string source = largeSource();
+    std::istringstream in(source);
+    const long long before = allocatedByteCount();
+    CompiledTemplate chunked(in, 4096);
+    EXPECT_LT(allocatedByteCount() - before, (long long)source.size() + 4096);
+    EXPECT_EQ(source, chunked.sourceCode.str());
+}
+
+TEST(testSpeedTemplates, chunkedParseErrors) {
+    const char *sources[] = {
+        "abc {{ x }",
+        "abc {% for i in range(3)",
+        "{% for i in range(3) %}",
+        "{% for i in range(3) %}{% endif %}",
+    };
+    for(size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        std::string expected;
+        try {
+            CompiledTemplate whole(sources[i]);
+        } catch(render_error &e) {
+            expected = e.what();
+        }
+        ASSERT_NE(std::string(""), expected);
+        for(size_t chunkSize = 1; chunkSize < 8; chunkSize++) {
+            std::istringstream in(sources[i]);
+            try {
+                CompiledTemplate chunked(in, chunkSize);
+                FAIL() << "no exception for " << sources[i];
+            } catch(render_error &e) {
+                EXPECT_EQ(expected, e.what());
+            }
+        }
+    }
+}
+
+TEST(testSpeedTemplates, serialize) {
+    const char *sources[] = {
+        "",
+        "plain text",
+        "abc {{ x }}def{{y}}{% if x %}ghi{% endif %}",
+        "{% for i in range(its) %}[{{i}}{% for j in range(2) %}{{j}}{% endfor %}]{% endfor %}",
+        "{% if not flag %}a{% endif %}{% if True %}b{% endif %}{% if not False %}c{% endif %}",
+    };
+    for(size_t i = 0; i < sizeof(sources) / sizeof(sources[0]); i++) {
+        CompiledTemplate parsed(sources[i]);
+        const std::string blob = parsed.serialize();
+        std::shared_ptr<const CompiledTemplate> loaded = CompiledTemplate::load(TemplateSource::fromString(blob));
+        EXPECT_EQ(renderVariants(parsed), renderVariants(*loaded));
+        EXPECT_EQ(blob, loaded->serialize());
+    }
+}
+
+TEST(testSpeedTemplates, loadFromFile) {
+    const std::string path = "testJinja2CppLight_loadFromFile.tmp";
+    {
+        CompiledTemplate parsed("{% for i in range(its) %}[{{i}}]{% endfor %}" + std::string(1024 * 1024, '.'));
+        std::ofstream file(path.c_str(), std::ios::binary);
+        file << parsed.serialize();
+    }
+    std::shared_ptr<const TemplateSource> blob = TemplateSource::mapFile(path);
+    // the source is used in place, inside the mapping, rather than copied out of it
+    const long long before = allocatedByteCount();
+    std::shared_ptr<const CompiledTemplate> loaded = CompiledTemplate::load(blob);
+    EXPECT_LT(allocatedByteCount() - before, 64 * 1024);
+    std::map<std::string, Value> values;
+    values["its"] = Value(2);
+    EXPECT_EQ("[0][1]" + std::string(1024 * 1024, '.'), loaded->render(values));
+    loaded.reset();
+    blob.reset();
+    remove(path.c_str());
+}
+
+TEST(testSpeedTemplates, loadCorrupt) {
+    const std::string blob = CompiledTemplate("a{{b}}{% for i in range(n) %}{% if i %}{{i}}{% endif %}{% endfor %}").serialize();
+    // every truncation is detected
+    for(size_t length = 0; length < blob.size(); length++) {
+        EXPECT_THROW(CompiledTemplate::load(TemplateSource::fromString(blob.substr(0, length))), render_error);
+    }
+    EXPECT_THROW(CompiledTemplate::load(TemplateSource::fromString(blob + "x")), render_error);
+    std::string badMagic = blob;
+    badMagic[0] = 'X';
+    try {
+        CompiledTemplate::load(TemplateSource::fromString(badMagic));
+        FAIL();
+    } catch(render_error &e) {
+        EXPECT_EQ(std::string("not a compiled template"), e.what());
+    }
+    std::string badVersion = blob;
+    badVersion[4] = 7;
+    try {
+        CompiledTemplate::load(TemplateSource::fromString(badVersion));
+        FAIL();
+    } catch(render_error &e) {
+        EXPECT_EQ(std::string("compiled template version 7 not supported, expected 1"), e.what());
+    }
+    // flipping any single byte either still loads, or throws render_error
+    for(size_t i = 0; i < blob.size(); i++) {
+        std::string corrupt = blob;
+        corrupt[i] ^= 0x55;
+        try {
+            CompiledTemplate::load(TemplateSource::fromString(corrupt));
+        } catch(render_error &) {
+        }
+    }
+}
+
+namespace {
+    void appendU32(std::string &blob, uint32_t value) {
+        for(int i = 0; i < 4; i++) {
+            blob += (char)(value >> (8 * i));
+        }
+    }
+    void appendU64(std::string &blob, uint64_t value) {
+        for(int i = 0; i < 8; i++) {
+            blob += (char)(value >> (8 * i));
+        }
+    }
+}
+
+// a blob that chains code sections inside each other, which the parser never
+// produces, is rejected, rather than loading a tree too deep to destroy
+TEST(testSpeedTemplates, loadNestedCode) {
+    std::string blob = "J2CL";
+    appendU32(blob, 1); // version
+    appendU32(blob, 0); // slots
+    appendU64(blob, 1);
+    blob += "x"; // source
+    appendU32(blob, 1); // sections in root
+    const int depth = 200000;
+    for(int i = 0; i < depth; i++) {
+        blob += (char)1; // code
+        appendU32(blob, i + 1 < depth ? 1 : 0); // children
+        appendU64(blob, 0); // start
+        appendU64(blob, 1); // end
+        appendU32(blob, 0); // segments
+    }
+    try {
+        CompiledTemplate::load(TemplateSource::fromString(blob));
+        FAIL() << "expected render_error";
+    } catch(render_error &e) {
+        EXPECT_EQ(std::string("compiled template corrupt: code section with children"), e.what());
+    }
+}
+
+TEST(testSpeedTemplates, bundle) {
+    TemplateBundleWriter writer;
+    std::vector<std::string> names;
+    for(int i = 0; i < 50; i++) {
+        names.push_back("kernel" + toString(i));
+        writer.add(names.back(), CompiledTemplate("kernel " + toString(i) + ": {% for j in range(n) %}{{j}}{% endfor %}"));
+    }
+    EXPECT_THROW(writer.add("kernel3", CompiledTemplate("")), render_error);
+    const std::string blob = writer.serialize();
+
+    TemplateBundle bundle(TemplateSource::fromString(blob));
+    ASSERT_EQ(50u, bundle.size());
+    std::map<std::string, Value> values;
+    values["n"] = Value(3);
+    for(int i = 0; i < 50; i++) {
+        EXPECT_EQ(names[i], bundle.name(i));
+        EXPECT_TRUE(bundle.contains(names[i]));
+        std::shared_ptr<const CompiledTemplate> compiled = bundle.load(names[i]);
+        EXPECT_EQ("kernel " + toString(i) + ": 012", compiled->render(values));
+    }
+    EXPECT_FALSE(bundle.contains("kernel50"));
+    EXPECT_FALSE(bundle.contains(""));
+    try {
+        bundle.load("nosuchkernel");
+        FAIL();
+    } catch(render_error &e) {
+        EXPECT_EQ(std::string("template nosuchkernel not found in bundle"), e.what());
+    }
+
+    TemplateBundle empty(TemplateSource::fromString(TemplateBundleWriter().serialize()));
+    EXPECT_EQ(0u, empty.size());
+    EXPECT_FALSE(empty.contains("kernel0"));
+}
+
+TEST(testSpeedTemplates, bundleOutlivesLoadedTemplates) {
+    TemplateBundleWriter writer;
+    writer.add("a", CompiledTemplate("hello {{x}}"));
+    std::shared_ptr<const CompiledTemplate> compiled;
+    {
+        TemplateBundle bundle(TemplateSource::fromString(writer.serialize()));
+        compiled = bundle.load("a");
+    }
+    std::map<std::string, Value> values;
+    values["x"] = Value("world");
+    EXPECT_EQ(std::string("hello world"), compiled->render(values));
+}
+
+TEST(testSpeedTemplates, bundleCorrupt) {
+    TemplateBundleWriter writer;
+    writer.add("a", CompiledTemplate("hello {{x}}"));
+    writer.add("b", CompiledTemplate("{% if x %}b{% endif %}"));
+    const std::string blob = writer.serialize();
+    for(size_t length = 0; length < blob.size(); length++) {
+        try {
+            TemplateBundle bundle(TemplateSource::fromString(blob.substr(0, length)));
+            bundle.load("a");
+            bundle.load("b");
+            FAIL() << "truncated to " << length;
+        } catch(render_error &) {
+        }
+    }
+    for(size_t i = 0; i < blob.size(); i++) {
+        std::string corrupt = blob;
+        corrupt[i] ^= 0x55;
+        try {
+            TemplateBundle bundle(TemplateSource::fromString(corrupt));
+            if(bundle.contains("a")) {
+                bundle.load("a");
+            }
+        } catch(render_error &) {
+        }
+    }
+}
@@ -0,0 +1,135 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, 
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <iostream>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <limits>
+
+#include "numberformat.h"
+
+#include "gtest/gtest.h"
+#include "test/gtest_supp.h"
+
+using namespace std;
+
+namespace {
+    string formatIntString( int value ) {
+        char buffer[FORMAT_INT_MAX_CHARS];
+        return string( buffer, formatInt( value, buffer ) );
+    }
+    string formatFloatString( float value ) {
+        char buffer[FORMAT_FLOAT_MAX_CHARS];
+        return string( buffer, formatFloat( value, buffer ) );
+    }
+    string formatFloatFixedString( float value, int precision ) {
+        char buffer[FORMAT_FLOAT_FIXED_MAX_CHARS];
+        return string( buffer, formatFloatFixed( value, precision, buffer ) );
+    }
+    float floatFromBits( unsigned int bits ) {
+        float value;
+        memcpy( &value, &bits, sizeof( value ) );
+        return value;
+    }
+}
+
+TEST( testnumberformat, ints ) {
+    EXPECT_EQ( "0", formatIntString( 0 ) );
+    EXPECT_EQ( "7", formatIntString( 7 ) );
+    EXPECT_EQ( "10", formatIntString( 10 ) );
+    EXPECT_EQ( "-42", formatIntString( -42 ) );
+    EXPECT_EQ( "100", formatIntString( 100 ) );
+    EXPECT_EQ( "123456789", formatIntString( 123456789 ) );
+    EXPECT_EQ( "2147483647", formatIntString( INT_MAX ) );
+    EXPECT_EQ( "-2147483648", formatIntString( INT_MIN ) );
+    for( int i = -1000; i < 1000; i++ ) {
+        EXPECT_EQ( toString( i ), formatIntString( i ) );
+    }
+}
+
+TEST( testnumberformat, floatsMatchOstream ) {
+    // where ostream's default 6 significant digits are enough, the output is the same
+    EXPECT_EQ( "12.123", formatFloatString( 12.123f ) );
+    EXPECT_EQ( "0", formatFloatString( 0.0f ) );
+    EXPECT_EQ( "-0", formatFloatString( -0.0f ) );
+    EXPECT_EQ( "1", formatFloatString( 1.0f ) );
+    EXPECT_EQ( "0.1", formatFloatString( 0.1f ) );
+    EXPECT_EQ( "-2.5", formatFloatString( -2.5f ) );
+    EXPECT_EQ( "0.0001", formatFloatString( 0.0001f ) );
+    EXPECT_EQ( "1e-05", formatFloatString( 0.00001f ) );
+    EXPECT_EQ( "100000", formatFloatString( 100000.0f ) );
+    EXPECT_EQ( "1e+06", formatFloatString( 1000000.0f ) );
+    EXPECT_EQ( "1e+10", formatFloatString( 1e10f ) );
+    EXPECT_EQ( "1.5e+20", formatFloatString( 1.5e20f ) );
+    EXPECT_EQ( "inf", formatFloatString( numeric_limits<float>::infinity() ) );
+    EXPECT_EQ( "-inf", formatFloatString( -numeric_limits<float>::infinity() ) );
+    EXPECT_EQ( "nan", formatFloatString( numeric_limits<float>::quiet_NaN() ) );
+    for( int i = -100; i < 100; i++ ) {
+        float value = i * 0.25f;
+        EXPECT_EQ( toString( value ), formatFloatString( value ) );
+    }
+}
+
+TEST( testnumberformat, floatsShortest ) {
+    EXPECT_EQ( "1234567", formatFloatString( 1234567.0f ) );
+    EXPECT_EQ( "16777216", formatFloatString( 16777216.0f ) );
+    EXPECT_EQ( "0.3", formatFloatString( 0.3f ) );
+    EXPECT_EQ( "0.33333334", formatFloatString( 1.0f / 3 ) );
+    EXPECT_EQ( "3.4028235e+38", formatFloatString( numeric_limits<float>::max() ) );
+    EXPECT_EQ( "1.1754944e-38", formatFloatString( numeric_limits<float>::min() ) );
+    EXPECT_EQ( "1e-45", formatFloatString( numeric_limits<float>::denorm_min() ) );
+    EXPECT_EQ( "3.1415927", formatFloatString( 3.14159265358979f ) );
+}
+
+TEST( testnumberformat, floatsRoundTrip ) {
+    // walk through a spread of bit patterns, covering denormals, and each
+    // exponent, and check each reads back as the same float, and that one
+    // digit fewer wouldnt have been enough
+    for( unsigned int bits = 1; bits < 0x7f800000u; bits += 0x7f801u ) {
+        float value = floatFromBits( bits );
+        string formatted = formatFloatString( value );
+        EXPECT_EQ( value, strtof( formatted.c_str(), 0 ) ) << formatted;
+        string mantissa = formatted.substr( 0, formatted.find( 'e' ) );
+        int significantDigits = 0;
+        bool leading = true;
+        for( size_t i = 0; i < mantissa.size(); i++ ) {
+            if( mantissa[i] >= '1' && mantissa[i] <= '9' ) {
+                leading = false;
+            }
+            if( !leading && mantissa[i] >= '0' && mantissa[i] <= '9' ) {
+                significantDigits++;
+            }
+        }
+        if( significantDigits > 1 ) {
+            char shorter[64];
+            snprintf( shorter, sizeof( shorter ), "%.*e", significantDigits - 2, value );
+            EXPECT_NE( value, strtof( shorter, 0 ) ) << formatted << " " << shorter;
+        }
+    }
+}
+
+TEST( testnumberformat, floatsFixed ) {
+    EXPECT_EQ( "12.12", formatFloatFixedString( 12.123f, 2 ) );
+    EXPECT_EQ( "12", formatFloatFixedString( 12.123f, 0 ) );
+    EXPECT_EQ( "0.000", formatFloatFixedString( 0.0f, 3 ) );
+    EXPECT_EQ( "-0.000", formatFloatFixedString( -0.0001f, 3 ) );
+    EXPECT_EQ( "10.0", formatFloatFixedString( 9.96f, 1 ) );
+    EXPECT_EQ( "0.01", formatFloatFixedString( 0.006f, 2 ) );
+    EXPECT_EQ( "2", formatFloatFixedString( 2.5f, 0 ) );
+    EXPECT_EQ( "4", formatFloatFixedString( 3.5f, 0 ) );
+    EXPECT_EQ( "inf", formatFloatFixedString( numeric_limits<float>::infinity(), 2 ) );
+    for( unsigned int bits = 1; bits < 0x7f800000u; bits += 0x3f7ff1u ) {
+        float value = floatFromBits( bits );
+        for( int precision = 0; precision < 12; precision += 5 ) {
+            char expected[FORMAT_FLOAT_FIXED_MAX_CHARS + 1];
+            snprintf( expected, sizeof( expected ), "%.*f", precision, value );
+            EXPECT_EQ( string( expected ), formatFloatFixedString( value, precision ) );
+        }
+    }
+}
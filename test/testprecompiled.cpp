@@ -0,0 +1,42 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, 
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// testtemplates.h is generated from test/templates at build time, by
+// jinja2cpplight_precompile_templates, in CMakeLists.txt
+
+#include <string>
+#include <map>
+
+#include "testtemplates.h"
+
+#include "gtest/gtest.h"
+#include "test/gtest_supp.h"
+
+using namespace std;
+using namespace Jinja2CppLight;
+
+TEST( testprecompiled, bundle ) {
+    const TemplateBundle &bundle = testtemplates();
+    ASSERT_EQ( 2u, bundle.size() );
+    EXPECT_EQ( "greeting.tmpl", bundle.name( 0 ) );
+    EXPECT_EQ( "kernel.cl", bundle.name( 1 ) );
+    EXPECT_EQ( &bundle, &testtemplates() );
+}
+
+TEST( testprecompiled, render ) {
+    map< string, Value > values;
+    values["name"] = Value( "world" );
+    values["its"] = Value( 2 );
+    shared_ptr< const CompiledTemplate > greeting = testtemplates().load( "greeting.tmpl" );
+    EXPECT_EQ( "Hello world!\n", greeting->render( values ) );
+
+    // renders the same as parsing the template at runtime
+    shared_ptr< const CompiledTemplate > kernel = testtemplates().load( "kernel.cl" );
+    const string rendered = kernel->render( values );
+    EXPECT_NE( string::npos, rendered.find( "out[globalId * 2 + 1] = in[globalId * 2 + 1];" ) );
+    CompiledTemplate parsed( kernel->sourceCode.str() );
+    EXPECT_EQ( parsed.render( values ), rendered );
+}
@@ -86,3 +86,72 @@ TEST( teststringhelper, strcpy_safe ) {
     EXPECT_EQ( 'l', dest[2] );
 }
 
+
+TEST( teststringhelper, stringref ) {
+    string mystring = "hello world";
+    StringRef ref( mystring );
+    EXPECT_EQ( 11u, ref.size() );
+    EXPECT_EQ( 6u, ref.find( "world" ) );
+    EXPECT_EQ( StringRef::npos, ref.find( "worlds" ) );
+    EXPECT_EQ( StringRef::npos, ref.find( "o", 8 ) );
+    EXPECT_EQ( "wor", ref.substr( 6, 3 ).str() );
+    EXPECT_EQ( "world", ref.substr( 6 ).str() );
+    EXPECT_TRUE( ref.substr( 0, 5 ) == "hello" );
+}
+
+TEST( teststringhelper, splititerator ) {
+    const char *strings[] = { "42MP10MPMP54", "MP", "", "abc", "MPMP" };
+    for( int i = 0; i < 5; i++ ) {
+        vector<string> expected = split( strings[i], "MP" );
+        SplitIterator pieces( strings[i], "MP" );
+        StringRef piece;
+        vector<string> actual;
+        while( pieces.next( piece ) ) {
+            actual.push_back( piece.str() );
+        }
+        EXPECT_EQ( expected, actual );
+    }
+    vector<string> words = split( "for i in range(3)" );
+    ASSERT_EQ( 4u, words.size() );
+    EXPECT_EQ( "range(3)", words[3] );
+}
+
+TEST( teststringhelper, trim ) {
+    EXPECT_EQ( "a b", trim( " \r\n a b \n" ) );
+    EXPECT_EQ( "", trim( "  \n " ) );
+    EXPECT_EQ( "", trim( "" ) );
+    EXPECT_EQ( "a", trimRef( "a " ).str() );
+}
+
+TEST( teststringhelper, replaceglobalappend ) {
+    string result = "prefix:";
+    replaceGlobalAppend( result, "hellonewwohellorld", "hello", "one" );
+    EXPECT_EQ( "prefix:onenewwoonerld", result );
+
+    string target = "{% end for %}";
+    replaceGlobalInPlace( target, " ", "" );
+    EXPECT_EQ( "{%endfor%}", target );
+    target = "hello hello";
+    replaceGlobalInPlace( target, "hello", "goodbye" );
+    EXPECT_EQ( "goodbye goodbye", target );
+    target = "hello hello";
+    replaceGlobalInPlace( target, "hello", "one" );
+    EXPECT_EQ( "one one", target );
+}
+
+TEST( teststringhelper, hashstring ) {
+    EXPECT_EQ( hashString( "" ), hashString( StringRef( "abc", 0 ) ) );
+    // same text from different places hashes the same
+    const string text = "some text, long enough to use all of the lanes, and then some words, and some bytes";
+    for( size_t length = 0; length <= text.size(); length++ ) {
+        const string copy = text.substr( 0, length );
+        EXPECT_EQ( hashString( StringRef( text.data(), length ) ), hashString( copy ) );
+    }
+    // and changing any one char changes it
+    for( size_t i = 0; i < text.size(); i++ ) {
+        string changed = text;
+        changed[i] ^= 1;
+        EXPECT_NE( hashString( text ), hashString( changed ) );
+    }
+    EXPECT_NE( hashString( "a" ), hashString( StringRef( "a\0", 2 ) ) );
+}
@@ -0,0 +1,90 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, 
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <string>
+#include <vector>
+#include <cstdlib>
+
+#include "tagscan.h"
+
+#include "gtest/gtest.h"
+#include "test/gtest_supp.h"
+
+using namespace std;
+
+namespace {
+    typedef size_t (*FindFunction)( const char *data, size_t length, size_t from );
+
+    vector<FindFunction> implementations() {
+        vector<FindFunction> functions;
+        functions.push_back( findTagStart );
+        functions.push_back( findTagStartPortable );
+#ifdef JINJA2CPPLIGHT_TAGSCAN_X86
+        functions.push_back( findTagStartSse2 );
+        if( tagScanHasAvx2() ) {
+            functions.push_back( findTagStartAvx2 );
+        }
+#endif
+        return functions;
+    }
+
+    // the obvious version, to compare against
+    size_t findTagStartReference( const string &source, size_t from ) {
+        for( size_t i = from; i + 1 < source.size(); i++ ) {
+            const bool opens = source[i] == '{' && ( source[i + 1] == '{' || source[i + 1] == '%' );
+            const bool nextOpens = source[i + 1] == '{' && i + 2 < source.size() && ( source[i + 2] == '{' || source[i + 2] == '%' );
+            if( opens && !nextOpens ) {
+                return i;
+            }
+        }
+        return source.size();
+    }
+}
+
+TEST( testtagscan, basic ) {
+    vector<FindFunction> functions = implementations();
+    for( size_t i = 0; i < functions.size(); i++ ) {
+        FindFunction find = functions[i];
+        string source = "abc {{x}} def";
+        EXPECT_EQ( 4u, find( source.data(), source.size(), 0 ) );
+        EXPECT_EQ( 4u, find( source.data(), source.size(), 4 ) );
+        EXPECT_EQ( source.size(), find( source.data(), source.size(), 5 ) );
+        source = "{ x } {%";
+        EXPECT_EQ( 6u, find( source.data(), source.size(), 0 ) );
+        source = "trailing {";
+        EXPECT_EQ( source.size(), find( source.data(), source.size(), 0 ) );
+        EXPECT_EQ( 0u, find( "", 0, 0 ) );
+        source = string( 100, 'a' ) + "{ {{";
+        EXPECT_EQ( 102u, find( source.data(), source.size(), 0 ) );
+        // the tag starts at the last brace of a run
+        source = string( 40, 'a' ) + "{{% for";
+        EXPECT_EQ( 41u, find( source.data(), source.size(), 0 ) );
+        source = string( 40, 'a' ) + "{{{{x}}";
+        EXPECT_EQ( 42u, find( source.data(), source.size(), 0 ) );
+        source = "{{{%" + string( 40, 'a' );
+        EXPECT_EQ( 2u, find( source.data(), source.size(), 0 ) );
+    }
+}
+
+TEST( testtagscan, matchesReference ) {
+    vector<FindFunction> functions = implementations();
+    const char alphabet[] = "{%a}";
+    srand( 1 );
+    for( int trial = 0; trial < 2000; trial++ ) {
+        // mostly plain text, so tags land at all offsets within a vector block
+        string source( rand() % 150, 'x' );
+        for( size_t i = 0; i < source.size(); i++ ) {
+            if( rand() % 8 == 0 ) {
+                source[i] = alphabet[rand() % 4];
+            }
+        }
+        const size_t from = source.size() == 0 ? 0 : rand() % source.size();
+        const size_t expected = findTagStartReference( source, from );
+        for( size_t i = 0; i < functions.size(); i++ ) {
+            ASSERT_EQ( expected, functions[i]( source.data(), source.size(), from ) ) << source << " from " << from;
+        }
+    }
+}
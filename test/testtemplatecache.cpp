@@ -0,0 +1,126 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <thread>
+
+#include "templatecache.h"
+
+#include "gtest/gtest.h"
+#include "test/gtest_supp.h"
+
+using namespace std;
+using namespace Jinja2CppLight;
+
+TEST(testtemplatecache, hitsAndMisses) {
+    TemplateCache cache;
+    shared_ptr<const CompiledTemplate> first = cache.get("hello {{name}}");
+    EXPECT_EQ(0, cache.hits());
+    EXPECT_EQ(1, cache.misses());
+
+    // a different string, with the same text
+    const string same = string("hello ") + "{{name}}";
+    shared_ptr<const CompiledTemplate> second = cache.get(same);
+    EXPECT_EQ(first.get(), second.get());
+    EXPECT_EQ(1, cache.hits());
+
+    shared_ptr<const CompiledTemplate> other = cache.get(TemplateSource::fromString("bye {{name}}"));
+    EXPECT_NE(first.get(), other.get());
+    EXPECT_EQ(2, cache.misses());
+    // the stats can be read through a const reference
+    const TemplateCache &constCache = cache;
+    EXPECT_EQ(2u, constCache.size());
+    EXPECT_EQ(same.size() + 12u, constCache.bytes());
+
+    map<string, Value> values;
+    values["name"] = Value("world");
+    EXPECT_EQ(string("hello world"), second->render(values));
+    EXPECT_EQ(string("bye world"), other->render(values));
+}
+
+TEST(testtemplatecache, parseErrorsArentCached) {
+    TemplateCache cache;
+    EXPECT_THROW(cache.get("{% for i in range(3) %}"), render_error);
+    EXPECT_THROW(cache.get("{% for i in range(3) %}"), render_error);
+    EXPECT_EQ(0u, cache.size());
+    EXPECT_EQ(2, cache.misses());
+}
+
+TEST(testtemplatecache, evictsLeastRecentlyUsed) {
+    // one shard, with room for three 10 byte templates
+    TemplateCache cache(30, 1);
+    shared_ptr<const CompiledTemplate> a = cache.get("template a");
+    cache.get("template b");
+    cache.get("template c");
+    cache.get("template a"); // now b is the oldest
+    cache.get("template d");
+    EXPECT_EQ(1, cache.evictions());
+    EXPECT_EQ(3u, cache.size());
+    EXPECT_EQ(30u, cache.bytes());
+
+    const long long misses = cache.misses();
+    cache.get("template a");
+    cache.get("template c");
+    cache.get("template d");
+    EXPECT_EQ(misses, cache.misses());
+    cache.get("template b");
+    EXPECT_EQ(misses + 1, cache.misses());
+
+    // evicted templates still in use stay alive
+    cache.clear();
+    EXPECT_EQ(0u, cache.size());
+    map<string, Value> values;
+    EXPECT_EQ(string("template a"), a->render(values));
+}
+
+TEST(testtemplatecache, templateUsesCache) {
+    TemplateCache cache;
+    for(int i = 0; i < 3; i++) {
+        Template mytemplate("{% for i in range(its) %}{{i}}{% endfor %}", cache);
+        mytemplate.setValue("its", 3 + i);
+        EXPECT_EQ(string("012345").substr(0, 3 + i), mytemplate.render());
+    }
+    EXPECT_EQ(1, cache.misses());
+    EXPECT_EQ(2, cache.hits());
+
+    Template fromGlobal("{{x}}", TemplateCache::global());
+    fromGlobal.setValue("x", 1);
+    EXPECT_EQ(string("1"), fromGlobal.render());
+}
+
+TEST(testtemplatecache, threads) {
+    TemplateCache cache(1024 * 1024, 4);
+    const int numThreads = 4;
+    const int numSources = 20;
+    vector<vector<const CompiledTemplate *> > seen(numThreads);
+    vector<shared_ptr<const CompiledTemplate> > keepAlive(numThreads * numSources * 10);
+    vector<thread> threads;
+    for(int t = 0; t < numThreads; t++) {
+        threads.push_back(thread([&cache, &seen, &keepAlive, t]() {
+            for(int round = 0; round < 10; round++) {
+                for(int s = 0; s < numSources; s++) {
+                    shared_ptr<const CompiledTemplate> compiled = cache.get("template " + toString(s) + " {{x}}");
+                    seen[t].push_back(compiled.get());
+                    keepAlive[(t * 10 + round) * numSources + s] = compiled;
+                }
+            }
+        }));
+    }
+    for(int t = 0; t < numThreads; t++) {
+        threads[t].join();
+    }
+    EXPECT_EQ(numThreads * numSources * 10, cache.hits() + cache.misses());
+    EXPECT_EQ((size_t)numSources, cache.size());
+    // every thread ended up with the same compiled template for each source
+    for(int t = 0; t < numThreads; t++) {
+        for(size_t i = 0; i < seen[t].size(); i++) {
+            EXPECT_EQ(seen[0][i], seen[t][i]);
+        }
+    }
+}
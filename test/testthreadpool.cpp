@@ -0,0 +1,110 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License,
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <chrono>
+
+#include "threadpool.h"
+
+#include "gtest/gtest.h"
+#include "test/gtest_supp.h"
+
+using namespace std;
+using namespace Jinja2CppLight;
+
+TEST(testthreadpool, runsEachIndexOnce) {
+    for(int numThreads = 0; numThreads <= 3; numThreads++) {
+        ThreadPool pool(numThreads);
+        EXPECT_EQ(numThreads, pool.size());
+        for(size_t count = 0; count < 50; count += 7) {
+            vector<atomic<int> > calls(count);
+            for(size_t i = 0; i < count; i++) {
+                calls[i] = 0;
+            }
+            pool.parallelFor(count, [&calls](size_t i) {
+                calls[i]++;
+            });
+            for(size_t i = 0; i < count; i++) {
+                EXPECT_EQ(1, calls[i].load());
+            }
+        }
+    }
+}
+
+TEST(testthreadpool, nested) {
+    ThreadPool pool(2);
+    atomic<int> total(0);
+    pool.parallelFor(8, [&pool, &total](size_t i) {
+        pool.parallelFor(8, [&total](size_t j) {
+            total += (int)j;
+        });
+    });
+    EXPECT_EQ(8 * 28, total.load());
+}
+
+TEST(testthreadpool, rethrowsLowestIndex) {
+    ThreadPool pool(3);
+    atomic<int> calls(0);
+    try {
+        pool.parallelFor(20, [&calls](size_t i) {
+            calls++;
+            if(i == 5 || i == 12) {
+                throw runtime_error("failed at " + toString(i));
+            }
+        });
+        FAIL() << "expected an exception";
+    } catch(runtime_error &e) {
+        EXPECT_EQ(string("failed at 5"), string(e.what()));
+    }
+    EXPECT_EQ(20, calls.load());
+}
+
+TEST(testthreadpool, workerIds) {
+    ThreadPool pool(3);
+    vector<atomic<int> > running(4);
+    for(int i = 0; i < 4; i++) {
+        running[i] = 0;
+    }
+    atomic<int> clashes(0);
+    atomic<int> outOfRange(0);
+    pool.parallelForWorker(1000, [&](size_t i, int worker) {
+        if(worker < 0 || worker > 3) {
+            outOfRange++;
+            return;
+        }
+        if(running[worker]++ != 0) {
+            clashes++;
+        }
+        this_thread::yield();
+        running[worker]--;
+    });
+    EXPECT_EQ(0, outOfRange.load());
+    EXPECT_EQ(0, clashes.load());
+}
+
+// a worker stuck on one long task has the rest of its share stolen
+TEST(testthreadpool, stealsFromBusyWorker) {
+    ThreadPool pool(1);
+    vector<int> ranBy(100, -1);
+    pool.parallelForWorker(100, [&ranBy](size_t i, int worker) {
+        if(i == 50) {
+            this_thread::sleep_for(chrono::milliseconds(50));
+        }
+        ranBy[i] = worker;
+    });
+    int stolen = 0;
+    for(size_t i = 0; i < 100; i++) {
+        EXPECT_NE(-1, ranBy[i]);
+        if(i > 50 && ranBy[i] == 0) {
+            stolen++;
+        }
+    }
+    EXPECT_LT(0, stolen);
+}
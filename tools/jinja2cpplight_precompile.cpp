@@ -0,0 +1,149 @@
+// Copyright Hugh Perkins 2015 hughperkins at gmail
+//
+// This Source Code Form is subject to the terms of the Mozilla Public License, 
+// v. 2.0. If a copy of the MPL was not distributed with this file, You can 
+// obtain one at http://mozilla.org/MPL/2.0/.
+
+// compiles templates at build time, and writes them out as C++, so that
+// programs start with them already compiled, and any parse errors fail the
+// build, rather than the first render.  Usage:
+//
+//     jinja2cpplight_precompile <output> <name> [templatename=]templatefile...
+//
+// writes <output>.h and <output>.cpp, which define
+//
+//     const Jinja2CppLight::TemplateBundle &<name>();
+//
+// returning a bundle of the templates, each named templatename, or if that
+// is omitted, the name of templatefile without its directory.  If <output> is
+// -, just the definitions are written to stdout, for cog_precompile.py to
+// embed in an existing source file.  See jinja2cpplight_precompile_templates
+// in CMakeLists.txt for the cmake side of this
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdio>
+
+#include "Jinja2CppLight.h"
+
+using namespace std;
+using namespace Jinja2CppLight;
+
+namespace {
+    bool isIdentifier( const string &name ) {
+        if( name.size() == 0 || ( name[0] >= '0' && name[0] <= '9' ) ) {
+            return false;
+        }
+        for( size_t i = 0; i < name.size(); i++ ) {
+            const char c = name[i];
+            if( !( ( c >= 'a' && c <= 'z' ) || ( c >= 'A' && c <= 'Z' ) || ( c >= '0' && c <= '9' ) || c == '_' ) ) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    string baseName( const string &path ) {
+        const size_t slash = path.find_last_of( "/\\" );
+        return slash == string::npos ? path : path.substr( slash + 1 );
+    }
+
+    // the bundle as a char array, and the function returning it
+    void writeDefinitions( ostream &out, const string &name, const string &bundle, const vector< string > &templateNames ) {
+        out << "// generated by jinja2cpplight_precompile, from templates:";
+        for( size_t i = 0; i < templateNames.size(); i++ ) {
+            out << " " << templateNames[i];
+        }
+        out << "\n";
+        out << "namespace {\n";
+        out << "    const unsigned char " << name << "Data[] = {";
+        char hex[8];
+        for( size_t i = 0; i < bundle.size(); i++ ) {
+            if( i % 16 == 0 ) {
+                out << "\n        ";
+            }
+            snprintf( hex, sizeof( hex ), "0x%02x,", (unsigned char)bundle[i] );
+            out << hex;
+        }
+        out << "\n    };\n";
+        out << "}\n";
+        out << "const Jinja2CppLight::TemplateBundle &" << name << "() {\n";
+        out << "    static const Jinja2CppLight::TemplateBundle bundle( Jinja2CppLight::TemplateSource::fromStatic(\n";
+        out << "        (const char *)" << name << "Data, sizeof( " << name << "Data ) ) );\n";
+        out << "    return bundle;\n";
+        out << "}\n";
+    }
+
+    // only replaces path if the contents would change, so that dependents
+    // arent rebuilt needlessly
+    bool writeFile( const string &path, const string &contents ) {
+        ifstream existing( path.c_str(), ios::binary );
+        if( existing ) {
+            ostringstream existingContents;
+            existingContents << existing.rdbuf();
+            if( existingContents.str() == contents ) {
+                return true;
+            }
+        }
+        existing.close();
+        ofstream out( path.c_str(), ios::binary );
+        out << contents;
+        return (bool)out;
+    }
+}
+
+int main( int argc, char *argv[] ) {
+    if( argc < 3 ) {
+        cerr << "usage: " << argv[0] << " <output> <name> [templatename=]templatefile..." << endl;
+        return 1;
+    }
+    const string output = argv[1];
+    const string name = argv[2];
+    if( !isIdentifier( name ) ) {
+        cerr << argv[0] << ": name " << name << " should be a C++ identifier" << endl;
+        return 1;
+    }
+    TemplateBundleWriter writer;
+    vector< string > templateNames;
+    for( int i = 3; i < argc; i++ ) {
+        const string argument = argv[i];
+        const size_t equals = argument.find( '=' );
+        const string path = equals == string::npos ? argument : argument.substr( equals + 1 );
+        const string templateName = equals == string::npos ? baseName( argument ) : argument.substr( 0, equals );
+        try {
+            CompiledTemplate compiled( TemplateSource::mapFile( path ) );
+            writer.add( templateName, compiled );
+        } catch( std::exception &e ) {
+            cerr << path << ": error: " << e.what() << endl;
+            return 1;
+        }
+        templateNames.push_back( templateName );
+    }
+    const string bundle = writer.serialize();
+
+    if( output == "-" ) {
+        writeDefinitions( cout, name, bundle, templateNames );
+        return 0;
+    }
+    ostringstream header;
+    header << "// generated by jinja2cpplight_precompile\n";
+    header << "\n";
+    header << "#pragma once\n";
+    header << "\n";
+    header << "#include \"Jinja2CppLight.h\"\n";
+    header << "\n";
+    header << "// the templates, compiled when this was built\n";
+    header << "const Jinja2CppLight::TemplateBundle &" << name << "();\n";
+    ostringstream source;
+    source << "#include \"" << baseName( output ) << ".h\"\n";
+    source << "\n";
+    writeDefinitions( source, name, bundle, templateNames );
+    if( !writeFile( output + ".h", header.str() ) || !writeFile( output + ".cpp", source.str() ) ) {
+        cerr << argv[0] << ": couldnt write " << output << ".h/.cpp" << endl;
+        return 1;
+    }
+    return 0;
+}